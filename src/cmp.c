@@ -21,22 +21,152 @@
 #include <tc/tc.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#define BLKSZ (256 * 1024)
+
+/* regular files are mapped, anything else is read in BLKSZ blocks */
+struct input {
+	const char *name;
+	int fd;
+	struct stat st;
+	const unsigned char *map;
+	unsigned char *buf;
+	off_t pos;
+};
+
+static void open_input(struct input *in, const char *name) {
+	in->name = name;
+	in->map = TC_NULL;
+	in->buf = TC_NULL;
+	in->pos = 0;
+
+	in->fd = tc_streql(name, "-") ? TC_STDIN : open(name, O_RDONLY);
+	if (in->fd == -1 || fstat(in->fd, &in->st) == -1) {
+		perror(name);
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	if (S_ISREG(in->st.st_mode) && in->st.st_size > 0) {
+		in->map = mmap(TC_NULL, in->st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (in->map == MAP_FAILED) {
+			in->map = TC_NULL;
+		} else {
+			madvise((void *) in->map, in->st.st_size, MADV_SEQUENTIAL);
+		}
+	}
+
+	if (in->map == TC_NULL) {
+		in->buf = (unsigned char *) tc_malloc(BLKSZ);
+		if (in->buf == TC_NULL) {
+			tc_puterrln("Out of Memory");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+}
+
+static void close_input(struct input *in) {
+	if (in->map != TC_NULL) {
+		munmap((void *) in->map, in->st.st_size);
+	}
+	if (in->buf != TC_NULL) {
+		in->buf = tc_free(in->buf);
+	}
+	if (in->fd != TC_STDIN) {
+		close(in->fd);
+	}
+}
+
+/* returns the next block, short only at EOF */
+static size_t next_block(struct input *in, const unsigned char **p) {
+	size_t len;
+	ssize_t n;
+
+	if (in->map != TC_NULL) {
+		len = in->st.st_size - in->pos < BLKSZ ? in->st.st_size - in->pos : BLKSZ;
+		*p = in->map + in->pos;
+		in->pos += len;
+		return len;
+	}
+
+	for (len = 0; len < BLKSZ; len += n) {
+		n = read(in->fd, in->buf + len, BLKSZ - len);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n == -1) {
+			perror(in->name);
+			tc_exit(TC_EXIT_FAILURE);
+		} else if (n == 0) {
+			break;
+		}
+	}
+	*p = in->buf;
+	in->pos += len;
+	return len;
+}
+
+/* index of the first differing byte, compared a word at a time */
+static size_t mismatch(const unsigned char *a, const unsigned char *b, size_t n) {
+	tc_uint64_t wa, wb;
+	size_t i;
+
+	for (i = 0; i + sizeof(wa) <= n; i += sizeof(wa)) {
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb) {
+			break;
+		}
+	}
+	for (; i < n && a[i] == b[i]; i++) {
+		;
+	}
+	return i;
+}
+
+/* counts newlines eight bytes at a time: each word is xor'd with a word
+ * of newlines and the zero bytes are flagged and popcounted.
+ */
+static long newlines(const unsigned char *p, size_t n) {
+	const tc_uint64_t nl = 0x0a0a0a0a0a0a0a0aULL;
+	const tc_uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+	tc_uint64_t w, x;
+	size_t i;
+	long count;
+
+	count = 0;
+	for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		x = w ^ nl;
+		count += __builtin_popcountll(~(((x & low7) + low7) | x | low7));
+	}
+	for (; i < n; i++) {
+		count += p[i] == '\n';
+	}
+	return count;
+}
+
 int main(int argc, char *argv[]) {
 
+	int flag_l;
 	int flag_s;
-	long byte;
+	int differ;
 	long line;
-	FILE *f1;
-	FILE *f2;
+	off_t pos;
+	size_t i, n, n1, n2;
+	const unsigned char *p1, *p2;
+	struct input in1, in2;
 
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'l', .longarg = "list", .description = "list the position and octal values of every differing byte", .has_value = 0 },
 		TC_PROG_ARG_SILENT,
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
@@ -44,6 +174,7 @@ int main(int argc, char *argv[]) {
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "cmp ./foo ./bar", .description = "compare two files ./foo and ./bar" },
+		{ .command = "cmp -l ./foo ./bar", .description = "list every byte where ./foo and ./bar differ" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -61,6 +192,7 @@ int main(int argc, char *argv[]) {
 	};
 
 	/* defaults */
+	flag_l = 0;
 	flag_s = 0;
 
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
@@ -68,6 +200,9 @@ int main(int argc, char *argv[]) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'l':
+				flag_l = 1;
+				break;
 			case 's':
 				flag_s = 1;
 				break;
@@ -86,42 +221,54 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	f1 = fopen(argv[0], "r");
-	if (f1 == TC_NULL) {
-		perror("fopen");
-		tc_exit(TC_EXIT_FAILURE);
-	}
-	f2 = fopen(argv[1], "r");
-	if (f2 == TC_NULL) {
-		fclose(f1);
-		perror("fopen");
+	open_input(&in1, argv[0]);
+	open_input(&in2, argv[1]);
+
+	/* regular files of different sizes can't be equal */
+	if (flag_s && S_ISREG(in1.st.st_mode) && S_ISREG(in2.st.st_mode) && in1.st.st_size != in2.st.st_size) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	byte = line = 1;
+	differ = 0;
+	line = 1;
+	pos = 0;
 	do {
-		int c1;
-		int c2;
-
-		c1 = getc(f1);
-		c2 = getc(f2);
+		n1 = next_block(&in1, &p1);
+		n2 = next_block(&in2, &p2);
+		n = n1 < n2 ? n1 : n2;
 
-		if (c1 != c2) {
-			if (!flag_s) {
-				fprintf(stdout, "%s %s differ: byte %ld, line %ld\n", argv[0], argv[1], byte, line);
+		for (i = 0; (i += mismatch(p1 + i, p2 + i, n - i)) < n; i++) {
+			if (flag_s) {
+				tc_exit(TC_EXIT_FAILURE);
+			} else if (!flag_l) {
+				line = in1.map != TC_NULL ? 1 + newlines(in1.map, pos + i) : line + newlines(p1, i);
+				fprintf(stdout, "%s %s differ: byte %lld, line %ld\n", argv[0], argv[1], (long long) pos + i + 1, line);
+				tc_exit(TC_EXIT_FAILURE);
 			}
-			tc_exit(TC_EXIT_FAILURE);
+			fprintf(stdout, "%lld %3o %3o\n", (long long) pos + i + 1, p1[i], p2[i]);
+			differ = 1;
 		}
 
-		if (c1 == '\n') {
-			line++;
+		/* a mapped file is only counted once a difference turns up */
+		if (!flag_s && !flag_l && in1.map == TC_NULL) {
+			line += newlines(p1, n);
 		}
-		byte++;
+		pos += n;
 
-	} while (!feof(f1) && !feof(f2) && !ferror(f1) && !feof(f2));
+		if (n1 != n2) {
+			if (flag_l) {
+				fflush(stdout);
+				fprintf(stderr, "cmp: EOF on %s after byte %lld\n", n1 < n2 ? argv[0] : argv[1], (long long) pos);
+			} else if (!flag_s) {
+				line = in1.map != TC_NULL ? 1 + newlines(in1.map, pos) : line;
+				fprintf(stdout, "%s %s differ: byte %lld, line %ld\n", argv[0], argv[1], (long long) pos + 1, line);
+			}
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	} while (n > 0);
 
-	fclose(f1);
-	fclose(f2);
+	close_input(&in1);
+	close_input(&in2);
 
-	tc_exit(TC_EXIT_SUCCESS);
+	tc_exit(differ ? TC_EXIT_FAILURE : TC_EXIT_SUCCESS);
 }
@@ -18,20 +18,320 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGN 4096
+#define DEFAULT_BLOCK (128 * 1024)
+#define MAX_BLOCK (1024 * 1024 * 1024)
+#define OFFLOAD_CHUNK (8 * 1024 * 1024)
+
+static volatile sig_atomic_t report_requested = 0;
+static struct timespec started;
+static off_t copied = 0;
+
+static void request_report(int sig) {
+	report_requested = 1;
+}
+
+static void report(void) {
+	struct timespec now;
+	double elapsed;
+
+	report_requested = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+	fprintf(stderr, "%lld bytes copied, %.3f s, %.1f MB/s\n", (long long) copied, elapsed, elapsed > 0 ? copied / elapsed / 1e6 : 0.0);
+}
+
+/* parses a byte count with an optional k, m or g suffix, returns -1 on error */
+static long long parse_size(const char *s) {
+	long long n;
+	char *end;
+
+	errno = 0;
+	n = strtoll(s, &end, 10);
+	if (errno != 0 || end == s || n <= 0) {
+		return -1;
+	}
+
+	switch (*end) {
+		case 'g': case 'G': n *= 1024;
+		/* fall through */
+		case 'm': case 'M': n *= 1024;
+		/* fall through */
+		case 'k': case 'K': n *= 1024;
+			end++;
+			break;
+	}
+
+	return *end == '\0' && n <= MAX_BLOCK ? n : -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t nwritten;
+#ifdef O_DIRECT
+	int flags, rc;
+#endif
+
+	while (len > 0) {
+		nwritten = write(fd, buf, len);
+		if (nwritten == -1 && errno == EINTR) {
+			continue;
+#ifdef O_DIRECT
+		} else if (nwritten == -1 && errno == EINVAL && ((flags = fcntl(fd, F_GETFL)) & O_DIRECT)) {
+			/* a short final block can't be written unbuffered, the rest still can */
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+			rc = write_all(fd, buf, len);
+			fcntl(fd, F_SETFL, flags);
+			return rc;
+#endif
+		} else if (nwritten <= 0) {
+			return TC_ERR;
+		}
+		buf += nwritten;
+		len -= nwritten;
+	}
+
+	return TC_OK;
+}
+
+static ssize_t read_some(int fd, char *buf, size_t len) {
+	ssize_t nread;
+#ifdef O_DIRECT
+	int flags;
+#endif
+
+	for (;;) {
+		nread = read(fd, buf, len);
+		if (nread == -1 && errno == EINTR) {
+			continue;
+#ifdef O_DIRECT
+		} else if (nread == -1 && errno == EINVAL && ((flags = fcntl(fd, F_GETFL)) & O_DIRECT)) {
+			/* the unaligned tail of a -n limited copy can't be read unbuffered */
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+			nread = read_some(fd, buf, len);
+			fcntl(fd, F_SETFL, flags);
+#endif
+		}
+		return nread;
+	}
+}
+
+#ifdef O_DIRECT
+/* only regular files; on a pipe O_DIRECT means packet mode */
+static void set_direct(int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+	}
+}
+#endif
+
+/* copies up to len bytes (or to EOF when len < 0) through the buffer */
+static int copy_rw(int in, int out, char *buf, size_t bs, off_t len) {
+	ssize_t nread;
+	size_t want, got;
+	int whole;
+
+	/* unbuffered output goes out in whole blocks, so short reads (from a
+	 * pipe, say) are topped up rather than leaving it unaligned
+	 */
+	whole = 0;
+#ifdef O_DIRECT
+	whole = (fcntl(out, F_GETFL) & O_DIRECT) != 0;
+#endif
+
+	while (len != 0) {
+		if (report_requested) {
+			report();
+		}
+		want = len > 0 && (off_t) bs > len ? (size_t) len : bs;
+		for (got = 0; got < want; ) {
+			nread = read_some(in, buf + got, want - got);
+			if (nread == -1) {
+				return TC_ERR;
+			} else if (nread == 0) {
+				break;
+			}
+			got += nread;
+			if (!whole) {
+				break;
+			}
+		}
+		if (got == 0) {
+			break;
+		} else if (write_all(out, buf, got) != TC_OK) {
+			return TC_ERR;
+		}
+		copied += got;
+		len -= len > 0 ? (off_t) got : 0;
+	}
+
+	return TC_OK;
+}
+
+/* copies a byte range between explicit offsets, used for sparse copies */
+static int copy_range(int in, off_t off_in, int out, off_t off_out, off_t len, char *buf, size_t bs) {
+	ssize_t n;
+	size_t want;
+
+	while (len > 0) {
+		if (report_requested) {
+			report();
+		}
+		want = (off_t) bs > len ? (size_t) len : bs;
+#if defined(__linux__)
+		n = copy_file_range(in, &off_in, out, &off_out, len > OFFLOAD_CHUNK ? OFFLOAD_CHUNK : (size_t) len, 0);
+		if (n > 0) {
+			copied += n;
+			len -= n;
+			continue;
+		}
+#endif
+		n = pread(in, buf, want, off_in);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return TC_ERR;
+		}
+		if (pwrite(out, buf, n, off_out) != n) {
+			return TC_ERR;
+		}
+		off_in += n;
+		off_out += n;
+		copied += n;
+		len -= n;
+	}
+
+	return TC_OK;
+}
+
+#ifdef SEEK_DATA
+/* copies only the data extents of a regular file, leaving holes unwritten */
+static int copy_sparse(int in, int out, char *buf, size_t bs, off_t len) {
+	struct stat st, sout;
+	off_t base_in, base_out, end, data, hole;
+
+	if (fstat(in, &st) == -1 || fstat(out, &sout) == -1) {
+		return TC_ERR;
+	} else if (!S_ISREG(st.st_mode) || !S_ISREG(sout.st_mode)) {
+		return TC_ERR;
+	}
+	base_in = lseek(in, 0, SEEK_CUR);
+	base_out = lseek(out, 0, SEEK_CUR);
+	if (base_in == -1 || base_out == -1) {
+		return TC_ERR;
+	}
+	end = len < 0 || base_in + len > st.st_size ? st.st_size : base_in + len;
+
+	for (data = base_in; data < end; data = hole) {
+		data = lseek(in, data, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) {
+			break;
+		} else if (data == -1) {
+			return TC_ERR;
+		} else if (data >= end) {
+			break;
+		}
+		hole = lseek(in, data, SEEK_HOLE);
+		if (hole == -1) {
+			return TC_ERR;
+		}
+		hole = hole > end ? end : hole;
+		if (copy_range(in, data, out, base_out + (data - base_in), hole - data, buf, bs) != TC_OK) {
+			return TC_ERR;
+		}
+	}
+
+	/* extend the output over any trailing hole */
+	if (ftruncate(out, base_out + (end - base_in)) == -1) {
+		return TC_ERR;
+	}
+	lseek(in, end, SEEK_SET);
+	lseek(out, base_out + (end - base_in), SEEK_SET);
+
+	return TC_OK;
+}
+#endif
+
+#if defined(__linux__)
+/* lets the kernel move the data with copy_file_range or splice; on TC_ERR
+ * the file offsets reflect what was copied so the caller can finish the
+ * job with read/write.
+ */
+static int copy_offload(int in, int out, off_t *len) {
+	struct stat sin, sout;
+	ssize_t n;
+	size_t want;
+	int use_splice;
+
+	if (fstat(in, &sin) == -1 || fstat(out, &sout) == -1) {
+		return TC_ERR;
+	}
+	if (S_ISREG(sin.st_mode) && S_ISREG(sout.st_mode)) {
+		use_splice = 0;
+	} else if (S_ISFIFO(sin.st_mode) || S_ISFIFO(sout.st_mode)) {
+		use_splice = 1;
+	} else {
+		return TC_ERR;
+	}
+
+	while (*len != 0) {
+		if (report_requested) {
+			report();
+		}
+		want = *len > 0 && *len < OFFLOAD_CHUNK ? (size_t) *len : OFFLOAD_CHUNK;
+		if (use_splice) {
+			n = splice(in, TC_NULL, out, TC_NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		} else {
+			n = copy_file_range(in, TC_NULL, out, TC_NULL, want, 0);
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1) {
+			return TC_ERR;
+		} else if (n == 0) {
+			break;
+		}
+		copied += n;
+		*len -= *len > 0 ? n : 0;
+	}
+
+	return TC_OK;
+}
+#endif
+
 int main(int argc, char *argv[]) {
 
-	int ch;
-	int n;
 	struct tc_prog_arg *arg;
-	int flag_n;
-	int flag_s;
+	long long flag_n;
+	long long flag_s;
+	int flag_d;
+	int flag_S;
+	int rc;
+	off_t len;
+	char *buf;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'd', .longarg = "direct", .description = "bypass the page cache with O_DIRECT", .has_value = 0 },
 		{ .arg = 'n', .longarg = "count", .description = "number of blocks to read", .has_value = 1 },
-		{ .arg = 's', .longarg = "size", .description = "block size (in bytes)", .has_value = 1 },
+		{ .arg = 's', .longarg = "size", .description = "block size (in bytes, k/m/g suffixes allowed)", .has_value = 1 },
+		{ .arg = 'S', .longarg = "sparse", .description = "preserve holes when copying between regular files", .has_value = 0 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
@@ -39,6 +339,9 @@ int main(int argc, char *argv[]) {
 	static struct tc_prog_example examples[] = {
 		{ .command = "copy < ./foo > ./bar", .description = "file copy - creates a copy of ./foo named ./bar" },
 		{ .command = "copy -n 5 -s 1024 < /dev/random > ./foo", .description = "copy 5 KB from /dev/random into ./foo" },
+		{ .command = "copy -d -s 4m < ./disk.img > /dev/sdb", .description = "write a disk image in 4 MB blocks without filling the page cache" },
+		{ .command = "copy -S < ./disk.img > ./backup.img", .description = "copy a sparse disk image without filling in its holes" },
+		{ .command = "kill -USR1 $(pgrep copy)", .description = "make a running copy report its progress on standard error" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -56,21 +359,32 @@ int main(int argc, char *argv[]) {
 	};
 
 	/* defaults */
+	flag_d = 0;
 	flag_n = -1; /* copy until EOF */
-	flag_s = 1; /* 1 byte */
+	flag_s = DEFAULT_BLOCK;
+	flag_S = 0;
 
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'd':
+				flag_d = 1;
+				break;
 			case 'n':
 				flag_n = tc_atoi(argval);
 				flag_n = flag_n < 0 ? -1 : flag_n;
 				break;
 			case 's':
-				flag_s = tc_atoi(argval);
-				flag_s = flag_s < 0 ? 1 : flag_s;
+				flag_s = parse_size(argval);
+				if (flag_s == -1) {
+					tc_args_show_usage(&prog);
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				break;
+			case 'S':
+				flag_S = 1;
 				break;
 			case 'V':
 				tc_args_show_version(&prog);
@@ -82,15 +396,52 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	if (flag_n == -1) {
-		tc_copylns(TC_STDIN, TC_STDOUT, -1);
-		tc_exit(TC_EXIT_SUCCESS);
-	} else {
-		int rc;
-		rc = TC_OK;
-		for (n = 0; n < flag_n && rc == TC_OK; n++) {
-			rc = tc_copynbytes(TC_STDIN, TC_STDOUT, flag_s);
+	len = flag_n == -1 ? -1 : (off_t) (flag_n * flag_s);
+
+	if (flag_d) {
+#ifdef O_DIRECT
+		/* unbuffered I/O needs aligned lengths as well as aligned memory */
+		flag_s = (flag_s + ALIGN - 1) / ALIGN * ALIGN;
+		set_direct(TC_STDIN);
+		set_direct(TC_STDOUT);
+#endif
+	}
+
+	if (posix_memalign((void **) &buf, ALIGN, flag_s) != 0) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	signal(SIGUSR1, request_report);
+
+	rc = TC_ERR;
+#ifdef SEEK_DATA
+	if (flag_S && !flag_d) {
+		rc = copy_sparse(TC_STDIN, TC_STDOUT, buf, flag_s, len);
+		if (rc != TC_OK && copied == 0) {
+			rc = TC_ERR;
+		} else if (rc != TC_OK) {
+			tc_puterrln("File I/O Error");
+			tc_exit(TC_EXIT_FAILURE);
 		}
-		tc_exit(rc == TC_OK ? TC_EXIT_SUCCESS : TC_EXIT_FAILURE);
 	}
+#endif
+#if defined(__linux__)
+	if (rc != TC_OK && !flag_d) {
+		rc = copy_offload(TC_STDIN, TC_STDOUT, &len);
+	}
+#endif
+	if (rc != TC_OK) {
+		rc = copy_rw(TC_STDIN, TC_STDOUT, buf, flag_s, len);
+	}
+
+	free(buf);
+
+	if (rc != TC_OK) {
+		tc_puterrln("File I/O Error");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	tc_exit(TC_EXIT_SUCCESS);
 }
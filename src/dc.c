@@ -28,47 +28,360 @@
 
 #define PROMPT "calc>"
 #define STSZ 10000
-static tc_int64_t stack[STSZ];
+#define CALLSZ 1024
+
+/* bytecode operations; OP_NUM and OP_STR are followed by an inline operand,
+ * register operations are followed by a one byte register name.
+ */
+enum op {
+	OP_END = 0,
+	OP_NUM,
+	OP_STR,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_DUP,
+	OP_DUMP,
+	OP_LOAD,
+	OP_STORE,
+	OP_PRINT,
+	OP_EXEC,
+	OP_LT,
+	OP_GT,
+	OP_EQ,
+	OP_QUIT,
+	OP_BAD
+};
+
+struct code {
+	unsigned char *ops;
+	size_t len;
+	size_t cap;
+};
+
+/* a [string] is compiled once when it is first seen and lives until exit */
+struct macro {
+	char *text;
+	size_t len;
+	struct code code;
+};
+
+struct value {
+	struct macro *str; /* TC_NULL for numbers */
+	tc_int64_t num;
+};
+
+static struct value stack[STSZ];
 static size_t sp = 0;
-static tc_int64_t reg[256];
+static struct value reg[256];
 
-static void push(tc_int64_t v) {
+static void push(struct value v) {
 	if (sp == STSZ) return;
 	stack[sp] = v;
 	sp++;
 }
 
-static tc_int64_t peek(void) {
-	if (sp == 0) return 0;
+static void pushnum(tc_int64_t n) {
+	struct value v;
+	v.str = TC_NULL;
+	v.num = n;
+	push(v);
+}
+
+static struct value peek(void) {
+	static struct value zero;
+	if (sp == 0) return zero;
 	return stack[sp-1];
 }
 
-static tc_int64_t pop(void) {
-	if (sp == 0) return 0;
+static struct value pop(void) {
+	static struct value zero;
+	if (sp == 0) return zero;
 	sp--;
 	return stack[sp];
 }
 
-static void number(void) {
-	int c, i;
-	char n[64];
+static void print(struct value v) {
+	if (v.str == TC_NULL) {
+		printf("%ld\n", v.num);
+	} else {
+		fwrite(v.str->text, 1, v.str->len, stdout);
+		fputc('\n', stdout);
+	}
+}
+
+static void emit(struct code *code, const void *p, size_t n) {
+	if (code->len + n > code->cap) {
+		code->cap = code->cap == 0 ? 64 : code->cap;
+		while (code->len + n > code->cap) {
+			code->cap *= 2;
+		}
+		code->ops = (unsigned char *) realloc(code->ops, code->cap);
+		if (code->ops == TC_NULL) {
+			tc_puterrln("Out of Memory");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	memcpy(code->ops + code->len, p, n);
+	code->len += n;
+}
+
+static void emitop(struct code *code, enum op op) {
+	unsigned char b = (unsigned char) op;
+	emit(code, &b, 1);
+}
+
+static void compile(const char *src, size_t len, struct code *code);
+
+static struct macro *macro(const char *src, size_t len) {
+	struct macro *m;
+
+	m = (struct macro *) tc_malloc(sizeof(struct macro));
+	if (m == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	tc_memset(m, '\0', sizeof(struct macro));
+	m->text = (char *) tc_malloc(len + 1);
+	if (m->text == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	memcpy(m->text, src, len);
+	m->text[len] = '\0';
+	m->len = len;
+	compile(m->text, m->len, &m->code);
+	return m;
+}
 
-	i = 0;
-	memset(n, '\0', 64);
-	do {
+/* translate dc source into bytecode terminated by OP_END */
+static void compile(const char *src, size_t len, struct code *code) {
+	size_t i, j, depth;
+	tc_int64_t n;
+	struct macro *m;
+	char num[64];
+	unsigned char r;
 
-		c = getc(stdin);
-		if (!tc_isdigit(c) || i >= 63) {
-			ungetc(c, stdin);
-			push(strtol(n, TC_NULL, n[0] == '0' ? 8 : 10));
-			return;
+	for (i = 0; i < len; i++) {
+		switch (src[i]) {
+			case '0':
+			case '1':
+			case '2':
+			case '3':
+			case '4':
+			case '5':
+			case '6':
+			case '7':
+			case '8':
+			case '9':
+				for (j = 0; i < len && tc_isdigit(src[i]) && j < sizeof(num) - 1; i++, j++) {
+					num[j] = src[i];
+				}
+				num[j] = '\0';
+				i--;
+				n = strtol(num, TC_NULL, num[0] == '0' ? 8 : 10);
+				emitop(code, OP_NUM);
+				emit(code, &n, sizeof(n));
+				break;
+			case '[':
+				for (j = i + 1, depth = 1; j < len; j++) {
+					if (src[j] == '[') {
+						depth++;
+					} else if (src[j] == ']' && --depth == 0) {
+						break;
+					}
+				}
+				m = macro(src + i + 1, j - i - 1);
+				emitop(code, OP_STR);
+				emit(code, &m, sizeof(m));
+				i = j;
+				break;
+			case '+': emitop(code, OP_ADD); break;
+			case '-': emitop(code, OP_SUB); break;
+			case '*': emitop(code, OP_MUL); break;
+			case '/': emitop(code, OP_DIV); break;
+			case '%': emitop(code, OP_MOD); break;
+			case 'd': emitop(code, OP_DUP); break;
+			case 'f': emitop(code, OP_DUMP); break;
+			case 'p': emitop(code, OP_PRINT); break;
+			case 'x': emitop(code, OP_EXEC); break;
+			case 'q': emitop(code, OP_QUIT); break;
+			case 'l':
+			case 's':
+			case '<':
+			case '>':
+			case '=':
+				if (i + 1 >= len) {
+					emitop(code, OP_BAD);
+					break;
+				}
+				switch (src[i]) {
+					case 'l': emitop(code, OP_LOAD); break;
+					case 's': emitop(code, OP_STORE); break;
+					case '<': emitop(code, OP_LT); break;
+					case '>': emitop(code, OP_GT); break;
+					case '=': emitop(code, OP_EQ); break;
+				}
+				i++;
+				r = (unsigned char) src[i];
+				emit(code, &r, 1);
+				break;
+			case '\n':
+			case ' ':
+				break;
+			default:
+				emitop(code, OP_BAD);
+				break;
 		}
-		n[i++] = (char) c;
-	} while (1);
+	}
+	emitop(code, OP_END);
+}
+
+/* run bytecode; macros are called through an explicit frame stack and a
+ * call in tail position reuses the current frame so loops run in constant
+ * space.
+ */
+static void run(const unsigned char *ops) {
+	const unsigned char *frames[CALLSZ];
+	const unsigned char *pc;
+	size_t fp;
+	struct value a, b;
+	struct macro *m;
+	tc_int64_t n;
+	unsigned char op, r;
+
+	fp = 0;
+	pc = ops;
+	for (;;) {
+		op = *pc++;
+		switch ((enum op) op) {
+			case OP_END:
+				if (fp == 0) {
+					return;
+				}
+				pc = frames[--fp];
+				break;
+			case OP_NUM:
+				memcpy(&n, pc, sizeof(n));
+				pc += sizeof(n);
+				pushnum(n);
+				break;
+			case OP_STR:
+				memcpy(&m, pc, sizeof(m));
+				pc += sizeof(m);
+				a.str = m;
+				a.num = 0;
+				push(a);
+				break;
+			case OP_ADD:
+				a = pop();
+				b = pop();
+				pushnum(b.num + a.num);
+				break;
+			case OP_SUB:
+				a = pop();
+				b = pop();
+				pushnum(b.num - a.num);
+				break;
+			case OP_MUL:
+				a = pop();
+				b = pop();
+				pushnum(b.num * a.num);
+				break;
+			case OP_DIV:
+			case OP_MOD:
+				a = pop();
+				b = pop();
+				if (a.num == 0) {
+					push(b);
+					push(a);
+					puts("?");
+				} else {
+					pushnum(op == OP_DIV ? b.num / a.num : b.num % a.num);
+				}
+				break;
+			case OP_DUP:
+				push(peek());
+				break;
+			case OP_DUMP:
+				while (sp > 0) {
+					print(pop());
+				}
+				break;
+			case OP_LOAD:
+				push(reg[*pc++]);
+				break;
+			case OP_STORE:
+				reg[*pc++] = pop();
+				break;
+			case OP_PRINT:
+				print(peek());
+				break;
+			case OP_EXEC:
+				a = pop();
+				if (a.str == TC_NULL) {
+					push(a);
+					break;
+				}
+				m = a.str;
+				goto call;
+			case OP_LT:
+			case OP_GT:
+			case OP_EQ:
+				r = *pc++;
+				a = pop();
+				b = pop();
+				if (op == OP_LT ? a.num < b.num : op == OP_GT ? a.num > b.num : a.num == b.num) {
+					if (reg[r].str == TC_NULL) {
+						push(reg[r]);
+						break;
+					}
+					m = reg[r].str;
+					goto call;
+				}
+				break;
+			case OP_QUIT:
+				tc_exit(TC_EXIT_SUCCESS);
+			case OP_BAD:
+				puts("?");
+				break;
+		}
+		continue;
+call:
+		if (*pc != OP_END) {
+			if (fp == CALLSZ) {
+				puts("?");
+				continue;
+			}
+			frames[fp++] = pc;
+		}
+		pc = m->code.ops;
+	}
+}
+
+/* a chunk is complete once every [ has been closed */
+static int balanced(const char *src, size_t len) {
+	size_t i;
+	long depth;
+
+	for (i = 0, depth = 0; i < len; i++) {
+		if (src[i] == '[') {
+			depth++;
+		} else if (src[i] == ']' && depth > 0) {
+			depth--;
+		}
+	}
+	return depth == 0;
 }
 
 int main(int argc, char *argv[]) {
 
+	char *line = TC_NULL, *chunk = TC_NULL;
+	size_t len = 0, chunklen = 0, chunkcap = 0;
+	ssize_t nread;
+	struct code code;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
@@ -79,6 +392,7 @@ int main(int argc, char *argv[]) {
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "dc", .description = "invoke the calculator" },
+		{ .command = "echo '5 [d p 1 - d 0 <a] d sa x' | dc", .description = "count down from 5 to 1 with a looping macro" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -110,86 +424,44 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	fprintf(stdout, "%s", PROMPT);
-	do {
-		int c;
-
-		switch ((c = getc(stdin))) {
-
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
-				ungetc(c, stdin);
-				number();
-				break;
-
-			case '+':
-				push(pop() + pop());
-				break;
-
-			case '-':
-				push(pop() - pop());
-				break;
-
-			case '*':
-				push(pop() * pop());
-				break;
-
-			case '/':
-				push(pop() / pop());
-				break;
-
-			case '%':
-				push(pop() % pop());
-				break;
+	tc_memset(&code, '\0', sizeof(struct code));
 
-			case 'd':
-				push(peek());
-				break;
-
-			case 'f':
-				while (sp > 0) {
-					printf("%ld\n", pop());
-				}
-				break;
-
-			case 'l':
-				c = getc(stdin);
-				push(reg[(unsigned char)c]);
-				break;
-
-			case 'p':
-				printf("%ld\n", peek());
-				break;
-
-			case 'q':
-				tc_exit(TC_EXIT_SUCCESS);
+	fprintf(stdout, "%s", PROMPT);
+	while ((nread = getline(&line, &len, stdin)) != -1) {
+		if (chunklen + nread > chunkcap) {
+			chunkcap = (chunklen + nread) * 2;
+			chunk = (char *) realloc(chunk, chunkcap);
+			if (chunk == TC_NULL) {
+				tc_puterrln("Out of Memory");
+				tc_exit(TC_EXIT_FAILURE);
+			}
+		}
+		memcpy(chunk + chunklen, line, nread);
+		chunklen += nread;
 
-			case 's':
-				c = getc(stdin);
-				reg[(unsigned char)c] = pop();
-				break;
+		/* [strings] may span several lines */
+		if (!balanced(chunk, chunklen)) {
+			continue;
+		}
 
-			case '\n':
-				fprintf(stdout, "%s", PROMPT);
-				break;
+		code.len = 0;
+		compile(chunk, chunklen, &code);
+		run(code.ops);
+		if (chunk[chunklen-1] == '\n') {
+			fprintf(stdout, "%s", PROMPT);
+		}
+		chunklen = 0;
+	}
 
-			case ' ':
-				break;
+	if (chunklen > 0) {
+		code.len = 0;
+		compile(chunk, chunklen, &code);
+		run(code.ops);
+	}
 
-			default:
-				puts("?");
-				break;
-		}
-	} while (!feof(stdin) && !ferror(stdin));
+	free(code.ops);
+	free(chunk);
+	free(line);
 
 	return 0;
 }
-
@@ -20,34 +20,387 @@
 
 #include <tc/tc.h>
 
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#define MAXGROUPS 32
+#define FLUSHSZ (64 * 1024)
+#define CHUNKSZ (8 * 1024 * 1024)
+#define TASKS_PER_THREAD 4
+#define MAXTHREADS 256
+
+/* the format is compiled once into literal and capture operations */
+struct op {
+	const char *text; /* literal text, TC_NULL for a capture */
+	size_t len;
+	long group;
+};
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+/* everything derived from the command line that each line is run through */
+struct compiled {
+	const char *pattern;
+	int cflags;
+	struct op *ops;
+	size_t nops;
+	size_t nmatch;
+	char *literal;
+};
+
+/* a newline aligned slice of a mapped file and the output it produced */
+struct task {
+	const char *start;
+	const char *end;
+	struct buffer out;
+};
+
+struct round {
+	const struct compiled *c;
+	struct task *tasks;
+	size_t ntasks;
+	size_t next; /* next task to claim */
+	int failed;
+};
+
+static void append(struct buffer *b, const char *s, size_t n) {
+	if (b->len + n > b->cap) {
+		b->cap = (b->len + n) * 2;
+		b->data = (char *) realloc(b->data, b->cap);
+		if (b->data == TC_NULL) {
+			tc_puterrln("Out of Memory");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+}
+
+static void flush(struct buffer *b, FILE *out) {
+	if (b->len > 0 && fwrite(b->data, 1, b->len, out) != b->len) {
+		tc_puterrln("Write Error");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	b->len = 0;
+}
+
+/* $N is capture N, $$ is a literal $, returns the number of operations */
+static size_t compile_format(const char *format, struct op *ops, long *maxgroup) {
+	size_t nops, i;
+	long group;
+	char *endnum;
+
+	nops = 0;
+	*maxgroup = 0;
+	for (i = 0; format[i] != '\0'; ) {
+		if (format[i] == '$' && tc_isdigit(format[i+1])) {
+			group = strtol(format + i + 1, &endnum, 10);
+			i = endnum - format;
+			if (group < MAXGROUPS) {
+				ops[nops].text = TC_NULL;
+				ops[nops].len = 0;
+				ops[nops].group = group;
+				nops++;
+				*maxgroup = group > *maxgroup ? group : *maxgroup;
+			}
+			continue;
+		}
+
+		/* extend the previous literal when it ends right here */
+		if (nops == 0 || ops[nops-1].text == TC_NULL || ops[nops-1].text + ops[nops-1].len != format + i) {
+			ops[nops].text = format + i;
+			ops[nops].len = 0;
+			ops[nops].group = -1;
+			nops++;
+		}
+		ops[nops-1].len++;
+		i += (format[i] == '$' && format[i+1] == '$') ? 2 : 1;
+	}
+
+	return nops;
+}
+
+static void render(struct buffer *b, const struct op *ops, size_t nops, const char *line, const regmatch_t *pmatch) {
+	size_t i;
+
+	for (i = 0; i < nops; i++) {
+		if (ops[i].text != TC_NULL) {
+			append(b, ops[i].text, ops[i].len);
+		} else if (pmatch[ops[i].group].rm_so != -1) {
+			append(b, line + pmatch[ops[i].group].rm_so, pmatch[ops[i].group].rm_eo - pmatch[ops[i].group].rm_so);
+		}
+	}
+	append(b, "\n", 1);
+}
+
+/* finds the longest literal that every match of an extended regular
+ * expression must contain; only text outside of groups and bracket
+ * expressions is considered and any alternation disables the search.
+ */
+static char *required_literal(const char *pattern) {
+	char *best, *run;
+	size_t bestlen, runlen, i, n;
+	int depth;
+	char ch;
+
+	n = tc_strlen(pattern);
+	best = (char *) tc_malloc(n + 1);
+	run = (char *) tc_malloc(n + 1);
+	if (best == TC_NULL || run == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	bestlen = runlen = 0;
+	depth = 0;
+
+	for (i = 0; i < n; i++) {
+		ch = pattern[i];
+		switch (ch) {
+			case '|':
+				best = tc_free(best);
+				run = tc_free(run);
+				return TC_NULL;
+			case '\\':
+				if (i + 1 < n && strchr(".[]()*+?{}|^$\\/", pattern[i+1]) != TC_NULL) {
+					ch = pattern[++i];
+					break;
+				}
+				i++;
+				ch = '\0';
+				break;
+			case '[':
+				i++;
+				if (i < n && pattern[i] == '^') {
+					i++;
+				}
+				if (i < n && pattern[i] == ']') {
+					i++;
+				}
+				for (; i < n && pattern[i] != ']'; i++) {
+					if (pattern[i] == '[' && i + 1 < n && strchr(":.=", pattern[i+1]) != TC_NULL) {
+						char close = pattern[i+1];
+						for (i += 2; i + 1 < n && !(pattern[i] == close && pattern[i+1] == ']'); i++) {
+							;
+						}
+						i++;
+					}
+				}
+				ch = '\0';
+				break;
+			case '(':
+				depth++;
+				ch = '\0';
+				break;
+			case ')':
+				depth--;
+				ch = '\0';
+				break;
+			case '{':
+				for (; i < n && pattern[i] != '}'; i++) {
+					;
+				}
+				ch = '\0';
+				break;
+			case '.':
+			case '^':
+			case '$':
+			case '*':
+			case '+':
+			case '?':
+				ch = '\0';
+				break;
+		}
+
+		/* a quantifier may make the last literal optional */
+		if (ch != '\0' && depth == 0 && i + 1 < n && strchr("*?{", pattern[i+1]) != TC_NULL) {
+			ch = '\0';
+		}
+
+		if (ch != '\0' && depth == 0) {
+			run[runlen++] = ch;
+			if (i + 1 < n && pattern[i+1] != '+') {
+				continue;
+			}
+		}
+
+		/* the run ends here */
+		if (runlen > bestlen) {
+			memcpy(best, run, runlen);
+			bestlen = runlen;
+		}
+		runlen = 0;
+	}
+	if (runlen > bestlen) {
+		memcpy(best, run, runlen);
+		bestlen = runlen;
+	}
+
+	run = tc_free(run);
+	if (bestlen == 0) {
+		best = tc_free(best);
+		return TC_NULL;
+	}
+	best[bestlen] = '\0';
+	return best;
+}
+
+static void extract_line(struct buffer *out, const struct compiled *c, regex_t *preg, regmatch_t *pmatch, char *line) {
+	/* lines without the pattern's required literal can skip regexec() */
+	if (c->literal != TC_NULL && strstr(line, c->literal) == TC_NULL) {
+		return;
+	}
+
+	if (regexec(preg, line, c->nmatch, pmatch, 0) == 0) {
+		render(out, c->ops, c->nops, line, pmatch);
+	}
+}
+
+static void *worker(void *arg) {
+	struct round *r = (struct round *) arg;
+	struct buffer line;
+	struct task *task;
+	regex_t preg;
+	regmatch_t pmatch[MAXGROUPS];
+	const char *p, *nl;
+	size_t t, n;
+
+	/* glibc serializes regexec() calls on a shared regex_t */
+	if (regcomp(&preg, r->c->pattern, r->c->cflags) != 0) {
+		r->failed = 1;
+		return TC_NULL;
+	}
+	tc_memset(&line, '\0', sizeof(struct buffer));
+
+	while ((t = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->ntasks) {
+		task = &r->tasks[t];
+		for (p = task->start; p < task->end; p = nl + 1) {
+			nl = memchr(p, '\n', task->end - p);
+			nl = nl == TC_NULL ? task->end : nl;
+			n = nl - p;
+			line.len = 0;
+			append(&line, p, n);
+			append(&line, "", 1);
+			extract_line(&task->out, r->c, &preg, pmatch, line.data);
+		}
+	}
+
+	free(line.data);
+	regfree(&preg);
+	return TC_NULL;
+}
+
+/* splits a regular file into newline aligned chunks that are processed
+ * by nthreads workers; output is written in input order.
+ */
+static int extract_parallel(FILE *in, const struct compiled *c, long nthreads) {
+	struct stat st;
+	struct round r;
+	struct task *tasks;
+	pthread_t threads[MAXTHREADS];
+	const char *map, *p, *end, *nl;
+	long i, nstarted;
+	size_t t, maxtasks;
+
+	if (fstat(fileno(in), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		return TC_ERR;
+	}
+	map = mmap(TC_NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+	if (map == MAP_FAILED) {
+		return TC_ERR;
+	}
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+	maxtasks = nthreads * TASKS_PER_THREAD;
+	tasks = (struct task *) tc_malloc(sizeof(struct task) * maxtasks);
+	if (tasks == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	tc_memset(tasks, '\0', sizeof(struct task) * maxtasks);
+
+	end = map + st.st_size;
+	for (p = map; p < end; ) {
+		for (t = 0; t < maxtasks && p < end; t++) {
+			tasks[t].start = p;
+			p = end - p > CHUNKSZ ? p + CHUNKSZ : end;
+			nl = p < end ? memchr(p, '\n', end - p) : TC_NULL;
+			p = nl == TC_NULL ? end : nl + 1;
+			tasks[t].end = p;
+			tasks[t].out.len = 0;
+		}
+
+		r.c = c;
+		r.tasks = tasks;
+		r.ntasks = t;
+		r.next = 0;
+		r.failed = 0;
+
+		nstarted = 0;
+		for (i = 1; i < nthreads && (size_t) i < r.ntasks; i++) {
+			if (pthread_create(&threads[nstarted], TC_NULL, worker, &r) != 0) {
+				break;
+			}
+			nstarted++;
+		}
+		worker(&r);
+		for (i = 0; i < nstarted; i++) {
+			pthread_join(threads[i], TC_NULL);
+		}
+		if (r.failed) {
+			tc_puterrln("unexpected error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+
+		for (t = 0; t < r.ntasks; t++) {
+			flush(&tasks[t].out, stdout);
+		}
+	}
+
+	for (t = 0; t < maxtasks; t++) {
+		free(tasks[t].out.data);
+	}
+	tasks = tc_free(tasks);
+	munmap((void *) map, st.st_size);
+
+	return TC_OK;
+}
+
 int main(int argc, char *argv[]) {
 
 	FILE *in = stdin;
 	regex_t preg;
-	regmatch_t pmatch[32];
-	size_t nmatch = sizeof(pmatch)/sizeof(pmatch[0]), nread = 0, len = 0;
-	char *pattern = TC_NULL, *format = TC_NULL, errbuf[128], *line = TC_NULL, *endnum = TC_NULL;
-	int cflags = REG_EXTENDED, eflags = 0, errcode;
-	ssize_t i;
-	long placeholder = 0;
+	regmatch_t pmatch[MAXGROUPS];
+	size_t len = 0;
+	ssize_t nread;
+	char *format = TC_NULL, errbuf[128], *line = TC_NULL;
+	int errcode;
+	long maxgroup, nthreads = 1;
+	struct compiled c;
+	struct buffer out;
 
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
 		{ .arg = 'i', .longarg = "ignore-case", .description = "case insensitive search", .has_value = 0 },
+		{ .arg = 'j', .longarg = "jobs", .description = "number of threads to use on a regular file", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "extract 'Invalid user (.*) from (.*) port' 'uid=$1 client_ip=$2' /var/log/auth.log", .description = "extract failed login attmpts (uid + ip) from auth.log" },
+		{ .command = "extract -j 8 '\"GET ([^ ]*)' '$1' access.log", .description = "extract requested paths from a large log using 8 threads" },
 
 		TC_PROG_EXAMPLE_END
 	};
@@ -65,11 +418,21 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	c.cflags = REG_EXTENDED;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'i':
+				c.cflags |= REG_ICASE;
+				break;
+			case 'j':
+				nthreads = tc_atoi(argval);
+				nthreads = nthreads < 1 ? 1 : nthreads > MAXTHREADS ? MAXTHREADS : nthreads;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -85,7 +448,7 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	pattern = argv[0];
+	c.pattern = argv[0];
 	format = argv[1];
 	if (argc == 3) {
 		in = fopen(argv[2], "r");
@@ -95,7 +458,7 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	errcode = regcomp(&preg, pattern, cflags);
+	errcode = regcomp(&preg, c.pattern, c.cflags);
 	if (errcode != 0) {
 		regerror(errcode, &preg, errbuf, sizeof(errbuf));
 		fprintf(stdout, "Bad Pattern: %s", errbuf);
@@ -103,27 +466,29 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	while ((nread = getline(&line, &len, in)) != -1) {
-		line[nread-1] = '\0';
+	c.ops = (struct op *) tc_malloc(sizeof(struct op) * (tc_strlen(format) + 1));
+	if (c.ops == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	c.nops = compile_format(format, c.ops, &maxgroup);
+	c.nmatch = maxgroup + 1;
+	c.literal = (c.cflags & REG_ICASE) == 0 ? required_literal(c.pattern) : TC_NULL;
 
-		errcode = regexec(&preg, line, nmatch, pmatch, eflags); 
-		if (errcode == 0) {
-			for (i = 0; i < tc_strlen(format); i++) {
-				if (format[i] == '$' && format[i+1] == '$') {
-					fputc(format[i], stdout);
-					i++;
-				} else if (format[i] == '$' && tc_isdigit(format[i+1])) {
-					placeholder = strtol(format + i + 1, &endnum, 10);
-					i = endnum - 1 - format;
-					if (placeholder >= 0 && placeholder < nmatch && pmatch[placeholder].rm_so != -1) {
-						fwrite(line + pmatch[placeholder].rm_so, pmatch[placeholder].rm_eo - pmatch[placeholder].rm_so, 1, stdout);
-					}
-				} else {
-					fputc(format[i], stdout);
-				}
+	tc_memset(&out, '\0', sizeof(struct buffer));
+
+	if (nthreads == 1 || extract_parallel(in, &c, nthreads) != TC_OK) {
+		while ((nread = getline(&line, &len, in)) != -1) {
+			if (nread > 0 && line[nread-1] == '\n') {
+				line[nread-1] = '\0';
+			}
+
+			extract_line(&out, &c, &preg, pmatch, line);
+			if (out.len >= FLUSHSZ) {
+				flush(&out, stdout);
 			}
-			fputc('\n', stdout);
 		}
+		flush(&out, stdout);
 	}
 
 	fclose(in);
@@ -131,7 +496,11 @@ int main(int argc, char *argv[]) {
 	if (line != TC_NULL) {
 		free(line);
 	}
+	if (c.literal != TC_NULL) {
+		c.literal = tc_free(c.literal);
+	}
+	free(out.data);
+	c.ops = tc_free(c.ops);
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
-
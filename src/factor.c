@@ -1,5 +1,5 @@
  /*
-    factor -- prints the prime factors of a number
+    factor -- prints the prime factors of numbers
     Copyright (C) 2022, 2023, 2024  Thomas Cort
 
     This program is free software: you can redistribute it and/or modify
@@ -20,51 +20,640 @@
 
 #include <tc/tc.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-static unsigned long factor(unsigned long ul) {
-        unsigned long i;
-	unsigned long s;
 
-	s = ul/2;
-        if (ul < 2) {
+#define SIEVESZ 4096
+#define MAXFACTORS 128
+#define TOKSZ 64
+#define BATCHSZ 16384
+#define CHUNKSZ 64
+#define BRENTM 128
+
+typedef unsigned __int128 uint128;
+
+#define U128_MAX (~(uint128) 0)
+
+static tc_uint32_t primes[SIEVESZ];
+static size_t nprimes = 0;
+
+/* primes below SIEVESZ for the trial division pre-pass */
+static void sieve(void) {
+	unsigned char composite[SIEVESZ];
+	size_t i, j;
+
+	tc_memset(composite, '\0', sizeof(composite));
+	for (i = 2; i < SIEVESZ; i++) {
+		if (composite[i]) {
+			continue;
+		}
+		primes[nprimes++] = i;
+		for (j = i * i; j < SIEVESZ; j += i) {
+			composite[j] = 1;
+		}
+	}
+}
+
+/* Montgomery arithmetic modulo an odd n with R = 2^64 */
+struct mont {
+	tc_uint64_t n;
+	tc_uint64_t ninv; /* n^-1 mod 2^64 */
+	tc_uint64_t one;  /* R mod n */
+};
+
+static void mont_init(struct mont *m, tc_uint64_t n) {
+	tc_uint64_t inv;
+	int i;
+
+	/* n is its own inverse mod 8, each Newton step doubles the bits */
+	inv = n;
+	for (i = 0; i < 5; i++) {
+		inv *= 2 - n * inv;
+	}
+	m->n = n;
+	m->ninv = inv;
+	m->one = (0 - n) % n;
+}
+
+static tc_uint64_t mont_to(const struct mont *m, tc_uint64_t a) {
+	return (tc_uint64_t) (((uint128) a << 64) % m->n);
+}
+
+static tc_uint64_t mont_mul(const struct mont *m, tc_uint64_t a, tc_uint64_t b) {
+	uint128 t, mn;
+	tc_uint64_t hi, mhi;
+
+	t = (uint128) a * b;
+	mn = (uint128) ((tc_uint64_t) t * m->ninv) * m->n;
+	hi = (tc_uint64_t) (t >> 64);
+	mhi = (tc_uint64_t) (mn >> 64);
+	return hi >= mhi ? hi - mhi : hi - mhi + m->n;
+}
+
+static tc_uint64_t mont_add(const struct mont *m, tc_uint64_t a, tc_uint64_t b) {
+	return a >= m->n - b ? a - (m->n - b) : a + b;
+}
+
+static tc_uint64_t gcd(tc_uint64_t a, tc_uint64_t b) {
+	while (b != 0) {
+		tc_uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* deterministic Miller-Rabin for odd n, these bases cover every n < 2^64 */
+static int is_prime(tc_uint64_t n) {
+	static const tc_uint64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+	struct mont m;
+	tc_uint64_t b, d, e, x, minus_one;
+	size_t i;
+	int r, s;
+
+	mont_init(&m, n);
+	minus_one = n - m.one;
+
+	d = n - 1;
+	for (s = 0; (d & 1) == 0; s++) {
+		d >>= 1;
+	}
+
+	for (i = 0; i < sizeof(bases)/sizeof(bases[0]); i++) {
+		if (bases[i] % n == 0) {
+			continue;
+		}
+
+		x = m.one;
+		b = mont_to(&m, bases[i]);
+		for (e = d; e != 0; e >>= 1) {
+			if (e & 1) {
+				x = mont_mul(&m, x, b);
+			}
+			b = mont_mul(&m, b, b);
+		}
+
+		if (x == m.one || x == minus_one) {
+			continue;
+		}
+		for (r = 1; r < s; r++) {
+			x = mont_mul(&m, x, x);
+			if (x == minus_one) {
+				break;
+			}
+		}
+		if (r == s) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Pollard-Brent rho; returns a non-trivial divisor of an odd composite n */
+static tc_uint64_t rho(tc_uint64_t n) {
+	struct mont m;
+	tc_uint64_t c, g, q, x, y, ys;
+	tc_uint64_t i, k, r, lim;
+
+	mont_init(&m, n);
+
+	for (c = m.one; ; c = mont_add(&m, c, m.one)) {
+		y = mont_add(&m, m.one, m.one);
+		x = y;
+		ys = y;
+		q = m.one;
+		g = 1;
+
+		for (r = 1; g == 1; r *= 2) {
+			x = y;
+			for (i = 0; i < r; i++) {
+				y = mont_add(&m, mont_mul(&m, y, y), c);
+			}
+			for (k = 0; k < r && g == 1; k += BRENTM) {
+				ys = y;
+				lim = r - k < BRENTM ? r - k : BRENTM;
+				for (i = 0; i < lim; i++) {
+					y = mont_add(&m, mont_mul(&m, y, y), c);
+					q = mont_mul(&m, q, x > y ? x - y : y - x);
+				}
+				g = gcd(q, n);
+			}
+		}
+
+		/* the batched product hit 0 mod n, step back one at a time */
+		if (g == n) {
+			do {
+				ys = mont_add(&m, mont_mul(&m, ys, ys), c);
+				g = gcd(x > ys ? x - ys : ys - x, n);
+			} while (g == 1);
+		}
+
+		if (g != n) {
+			return g;
+		}
+	}
+}
+
+/* n has no prime factors below SIEVESZ */
+static void split64(tc_uint64_t n, uint128 *factors, size_t *nfactors) {
+	tc_uint64_t d;
+
+	if (n == 1) {
+		return;
+	} else if (n < (tc_uint64_t) SIEVESZ * SIEVESZ || is_prime(n)) {
+		factors[(*nfactors)++] = n;
+		return;
+	}
+
+	d = rho(n);
+	split64(d, factors, nfactors);
+	split64(n / d, factors, nfactors);
+}
+
+/* Montgomery arithmetic modulo an odd n with R = 2^128 for inputs above 2^64 */
+struct mont128 {
+	uint128 n;
+	uint128 ninv; /* n^-1 mod 2^128 */
+	uint128 one;  /* R mod n */
+	uint128 r2;   /* R^2 mod n */
+};
+
+static void mul256(uint128 a, uint128 b, uint128 *hi, uint128 *lo) {
+	uint128 p00, p01, p10, p11, mid;
+	tc_uint64_t a0, a1, b0, b1;
+
+	a0 = (tc_uint64_t) a;
+	a1 = (tc_uint64_t) (a >> 64);
+	b0 = (tc_uint64_t) b;
+	b1 = (tc_uint64_t) (b >> 64);
+
+	p00 = (uint128) a0 * b0;
+	p01 = (uint128) a0 * b1;
+	p10 = (uint128) a1 * b0;
+	p11 = (uint128) a1 * b1;
+
+	mid = (p00 >> 64) + (tc_uint64_t) p01 + (tc_uint64_t) p10;
+	*lo = (mid << 64) | (tc_uint64_t) p00;
+	*hi = p11 + (p01 >> 64) + (p10 >> 64) + (mid >> 64);
+}
+
+static uint128 mont128_add(const struct mont128 *m, uint128 a, uint128 b) {
+	return a >= m->n - b ? a - (m->n - b) : a + b;
+}
+
+static void mont128_init(struct mont128 *m, uint128 n) {
+	uint128 inv;
+	int i;
+
+	inv = n;
+	for (i = 0; i < 6; i++) {
+		inv *= 2 - n * inv;
+	}
+	m->n = n;
+	m->ninv = inv;
+	m->one = (0 - n) % n;
+	m->r2 = m->one;
+	for (i = 0; i < 128; i++) {
+		m->r2 = mont128_add(m, m->r2, m->r2);
+	}
+}
+
+static uint128 mont128_mul(const struct mont128 *m, uint128 a, uint128 b) {
+	uint128 th, tl, mh, ml;
+
+	mul256(a, b, &th, &tl);
+	mul256(tl * m->ninv, m->n, &mh, &ml);
+	return th >= mh ? th - mh : th - mh + m->n;
+}
+
+static uint128 gcd128(uint128 a, uint128 b) {
+	while (b != 0) {
+		uint128 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Miller-Rabin with the first twenty prime bases; no finite base set is
+ * known to be exact above 2^64, so this is a strong probable prime test.
+ */
+static int is_prime128(uint128 n) {
+	static const tc_uint64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71 };
+	struct mont128 m;
+	uint128 b, d, e, x, minus_one;
+	size_t i;
+	int r, s;
+
+	mont128_init(&m, n);
+	minus_one = n - m.one;
+
+	d = n - 1;
+	for (s = 0; (d & 1) == 0; s++) {
+		d >>= 1;
+	}
+
+	for (i = 0; i < sizeof(bases)/sizeof(bases[0]); i++) {
+		x = m.one;
+		b = mont128_mul(&m, bases[i], m.r2);
+		for (e = d; e != 0; e >>= 1) {
+			if (e & 1) {
+				x = mont128_mul(&m, x, b);
+			}
+			b = mont128_mul(&m, b, b);
+		}
+
+		if (x == m.one || x == minus_one) {
+			continue;
+		}
+		for (r = 1; r < s; r++) {
+			x = mont128_mul(&m, x, x);
+			if (x == minus_one) {
+				break;
+			}
+		}
+		if (r == s) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint128 rho128(uint128 n) {
+	struct mont128 m;
+	uint128 c, g, q, x, y, ys;
+	tc_uint64_t i, k, r, lim;
+
+	mont128_init(&m, n);
+
+	for (c = m.one; ; c = mont128_add(&m, c, m.one)) {
+		y = mont128_add(&m, m.one, m.one);
+		x = y;
+		ys = y;
+		q = m.one;
+		g = 1;
+
+		for (r = 1; g == 1; r *= 2) {
+			x = y;
+			for (i = 0; i < r; i++) {
+				y = mont128_add(&m, mont128_mul(&m, y, y), c);
+			}
+			for (k = 0; k < r && g == 1; k += BRENTM) {
+				ys = y;
+				lim = r - k < BRENTM ? r - k : BRENTM;
+				for (i = 0; i < lim; i++) {
+					y = mont128_add(&m, mont128_mul(&m, y, y), c);
+					q = mont128_mul(&m, q, x > y ? x - y : y - x);
+				}
+				g = gcd128(q, n);
+			}
+		}
+
+		if (g == n) {
+			do {
+				ys = mont128_add(&m, mont128_mul(&m, ys, ys), c);
+				g = gcd128(x > ys ? x - ys : ys - x, n);
+			} while (g == 1);
+		}
+
+		if (g != n) {
+			return g;
+		}
+	}
+}
+
+/* n has no prime factors below SIEVESZ */
+static void split(uint128 n, uint128 *factors, size_t *nfactors) {
+	uint128 d;
+
+	if (n <= UINT64_MAX) {
+		split64((tc_uint64_t) n, factors, nfactors);
+		return;
+	} else if (is_prime128(n)) {
+		factors[(*nfactors)++] = n;
+		return;
+	}
+
+	d = rho128(n);
+	split(d, factors, nfactors);
+	split(n / d, factors, nfactors);
+}
+
+/* stores the prime factors of n in ascending order, returns the count */
+static size_t factor(uint128 n, uint128 *factors) {
+	size_t i, j, nfactors;
+	uint128 t;
+
+	nfactors = 0;
+	if (n < 2) {
+		return 0;
+	}
+
+	for (i = 0; i < nprimes && (uint128) primes[i] * primes[i] <= n; i++) {
+		if (n <= UINT64_MAX) {
+			tc_uint64_t n64 = (tc_uint64_t) n;
+			while (n64 % primes[i] == 0) {
+				factors[nfactors++] = primes[i];
+				n64 /= primes[i];
+			}
+			n = n64;
+		} else {
+			while (n % primes[i] == 0) {
+				factors[nfactors++] = primes[i];
+				n /= primes[i];
+			}
+		}
+	}
+
+	if (n > 1 && i < nprimes) {
+		factors[nfactors++] = n;
+	} else if (n > 1) {
+		split(n, factors, &nfactors);
+	}
+
+	for (i = 1; i < nfactors; i++) {
+		t = factors[i];
+		for (j = i; j > 0 && factors[j-1] > t; j--) {
+			factors[j] = factors[j-1];
+		}
+		factors[j] = t;
+	}
+
+	return nfactors;
+}
+
+/* parses a decimal integer, returns 0 on malformed input or overflow */
+static int parse(const char *s, uint128 *n) {
+	uint128 v;
+	unsigned d;
+
+	if (*s == '+') {
+		s++;
+	}
+	if (*s == '\0') {
 		return 0;
-	} else if (ul % 2 == 0) {
-		return 2;
 	}
 
-        for (i = 2; i <= s; i++) {
-		if (ul%i==0) {
-			return i;
+	for (v = 0; *s != '\0'; s++) {
+		if (!tc_isdigit(*s)) {
+			return 0;
 		}
+		d = *s - '0';
+		if (v > (U128_MAX - d) / 10) {
+			return 0;
+		}
+		v = v * 10 + d;
 	}
 
-        return ul;
+	*n = v;
+	return 1;
+}
+
+/* the output text of a run of consecutive jobs, built by one worker */
+struct chunk {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+struct job {
+	char tok[TOKSZ];
+	int valid;
+	size_t end; /* offset in the chunk's buffer just past this job's line */
+};
+
+struct batch {
+	struct job jobs[BATCHSZ];
+	struct chunk chunks[BATCHSZ / CHUNKSZ];
+	size_t njobs;
+	size_t next; /* next chunk to claim */
+};
+
+static void append(struct chunk *chunk, const char *s, size_t n) {
+	if (chunk->len + n > chunk->cap) {
+		chunk->cap = (chunk->len + n) * 2;
+		chunk->buf = (char *) realloc(chunk->buf, chunk->cap);
+		if (chunk->buf == TC_NULL) {
+			tc_puterrln("Out of Memory");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	memcpy(chunk->buf + chunk->len, s, n);
+	chunk->len += n;
+}
+
+static void append_num(struct chunk *chunk, uint128 n) {
+	char digits[40];
+	size_t i;
+
+	i = sizeof(digits);
+	do {
+		digits[--i] = '0' + (n % 10);
+		n /= 10;
+	} while (n != 0);
+	append(chunk, digits + i, sizeof(digits) - i);
+}
+
+static void *worker(void *arg) {
+	struct batch *batch = (struct batch *) arg;
+	uint128 n, factors[MAXFACTORS];
+	size_t c, i, j, nfactors;
+	struct chunk *chunk;
+	struct job *job;
+
+	while ((c = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) * CHUNKSZ < batch->njobs) {
+		chunk = &batch->chunks[c];
+		chunk->len = 0;
+		for (i = c * CHUNKSZ; i < (c + 1) * CHUNKSZ && i < batch->njobs; i++) {
+			job = &batch->jobs[i];
+			job->valid = parse(job->tok, &n);
+			if (job->valid) {
+				append_num(chunk, n);
+				append(chunk, ":", 1);
+				nfactors = factor(n, factors);
+				for (j = 0; j < nfactors; j++) {
+					append(chunk, " ", 1);
+					append_num(chunk, factors[j]);
+				}
+				append(chunk, "\n", 1);
+			}
+			job->end = chunk->len;
+		}
+	}
+
+	return TC_NULL;
+}
+
+/* factors every job in the batch on nthreads workers then prints in order */
+static int run(struct batch *batch, long nthreads) {
+	pthread_t threads[256];
+	size_t c, i, pos;
+	long t, nstarted;
+	int rc;
+
+	batch->next = 0;
+	nstarted = 0;
+	for (t = 1; t < nthreads && (size_t) t * CHUNKSZ < batch->njobs; t++) {
+		if (pthread_create(&threads[nstarted], TC_NULL, worker, batch) != 0) {
+			break;
+		}
+		nstarted++;
+	}
+	worker(batch);
+	for (t = 0; t < nstarted; t++) {
+		pthread_join(threads[t], TC_NULL);
+	}
+
+	rc = TC_EXIT_SUCCESS;
+	for (c = 0; c * CHUNKSZ < batch->njobs; c++) {
+		pos = 0;
+		for (i = c * CHUNKSZ; i < (c + 1) * CHUNKSZ && i < batch->njobs; i++) {
+			if (batch->jobs[i].valid) {
+				fwrite(batch->chunks[c].buf + pos, 1, batch->jobs[i].end - pos, stdout);
+			} else {
+				fflush(stdout);
+				fprintf(stderr, "factor: '%s' is not a valid positive integer\n", batch->jobs[i].tok);
+				rc = TC_EXIT_FAILURE;
+			}
+			pos = batch->jobs[i].end;
+		}
+	}
+	batch->njobs = 0;
+
+	return rc;
+}
+
+/* appends ch to tok, dropping leading zeros; an overlong token ends in
+ * "..." so that it is reported as invalid rather than misread.
+ */
+static void addch(char *tok, size_t *len, int *zeros, int ch) {
+	size_t start;
+
+	start = *len > 0 && tok[0] == '+' ? 1 : 0;
+	if (ch == '0' && *len == start) {
+		*zeros = 1;
+	} else if (*len < TOKSZ - 1) {
+		tok[(*len)++] = (char) ch;
+	} else {
+		memcpy(tok + TOKSZ - 4, "...", 3);
+	}
+}
+
+static void endtok(char *tok, size_t len, int zeros) {
+	if (zeros && len == (len > 0 && tok[0] == '+' ? 1 : 0)) {
+		tok[len++] = '0';
+	}
+	tok[len] = '\0';
+}
+
+/* reads the next whitespace separated token */
+static int token(FILE *in, char *tok) {
+	int ch, zeros;
+	size_t len;
+
+	do {
+		ch = getc(in);
+	} while (ch != EOF && tc_isspace(ch));
+	if (ch == EOF) {
+		return 0;
+	}
+
+	len = 0;
+	zeros = 0;
+	do {
+		addch(tok, &len, &zeros, ch);
+		ch = getc(in);
+	} while (ch != EOF && !tc_isspace(ch));
+	endtok(tok, len, zeros);
+
+	return 1;
+}
+
+static void argtoken(const char *arg, char *tok) {
+	int zeros;
+	size_t len;
+
+	len = 0;
+	zeros = 0;
+	for (; *arg != '\0'; arg++) {
+		addch(tok, &len, &zeros, (unsigned char) *arg);
+	}
+	endtok(tok, len, zeros);
 }
 
 
 int main(int argc, char *argv[]) {
 
-	unsigned long ul;
+	struct batch *batch;
+	long nthreads;
+	int i, rc;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'j', .longarg = "jobs", .description = "number of worker threads", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "factor 42", .description = "show the prime factors of 42" },
+		{ .command = "factor 18446744030759878681", .description = "show the prime factors of a 64-bit semiprime" },
+		{ .command = "factor 12 340282366920938463463374607431768211455", .description = "show the prime factors of several numbers, up to 128 bits" },
+		{ .command = "seq 1 1000000 | factor -j 4", .description = "factor numbers read from standard input on 4 threads" },
 		TC_PROG_EXAMPLE_END
 	};
 
 	static struct tc_prog prog = {
 		.program = "factor",
-		.usage = "[OPTIONS] INTEGER",
-		.description = "prints the prime factors of a number",
+		.usage = "[OPTIONS] [INTEGER...]",
+		.description = "prints the prime factors of numbers",
 		.package = TC_VERSION_NAME,
 		.version = TC_VERSION_STRING,
 		.copyright = TC_VERSION_COPYRIGHT,
@@ -74,11 +663,17 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'j':
+				nthreads = tc_atoi(argval);
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -89,25 +684,38 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	if (argc != 1) {
-		tc_args_show_usage(&prog);
+	nthreads = nthreads < 1 ? 1 : nthreads > 256 ? 256 : nthreads;
+
+	batch = (struct batch *) tc_malloc(sizeof(struct batch));
+	if (batch == TC_NULL) {
+		tc_puterrln("Out of Memory");
 		tc_exit(TC_EXIT_FAILURE);
 	}
+	tc_memset(batch, '\0', sizeof(struct batch));
 
-	ul = strtoul(argv[0], TC_NULL, 10);
-	fprintf(stdout, "%lu:", ul);
+	sieve();
 
-	do {
-		unsigned long fact;
-		fact = factor(ul);
-		if (fact < 2) {
-			break;
+	rc = TC_EXIT_SUCCESS;
+	if (argc > 0) {
+		for (i = 0; i < argc; i++) {
+			argtoken(argv[i], batch->jobs[batch->njobs].tok);
+			batch->njobs++;
+			if (batch->njobs == BATCHSZ && run(batch, nthreads) != TC_EXIT_SUCCESS) {
+				rc = TC_EXIT_FAILURE;
+			}
 		}
-		fprintf(stdout, " %lu", fact);
-		ul /= fact;
-	} while (1);
-
-	fprintf(stdout, "\n");
+	} else {
+		while (token(stdin, batch->jobs[batch->njobs].tok)) {
+			batch->njobs++;
+			if (batch->njobs == BATCHSZ && run(batch, nthreads) != TC_EXIT_SUCCESS) {
+				rc = TC_EXIT_FAILURE;
+			}
+		}
+	}
+	if (batch->njobs > 0 && run(batch, nthreads) != TC_EXIT_SUCCESS) {
+		rc = TC_EXIT_FAILURE;
+	}
 
-	tc_exit(TC_EXIT_SUCCESS);
+	fflush(stdout);
+	tc_exit(rc);
 }
@@ -20,92 +20,290 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-void foreach(int argc, char *argv[], char *line) {
+#define MAXJOBS 1024
+#define WINDOW 4 /* finished jobs kept per running job while waiting to print in order */
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]#~=!\n"
 
+extern char **environ;
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+enum kind { LITERAL, PLACEHOLDER, BLANK };
+
+struct part {
+	enum kind kind;
+	const char *text;
+	size_t len;
+};
+
+/* the command split at each {} placeholder; literals[i] comes before
+ * the i-th placeholder and the last literal follows the final one.
+ * parts is the same command cut at blanks as well, for building argv
+ * without a shell.
+ */
+struct template {
+	char **literals;
+	size_t *lens;
+	size_t nplaceholders;
+	int direct; /* no shell syntax outside of the placeholders */
+	struct part *parts;
+	size_t nparts;
+};
+
+/* the argv of one job, words are stored back to back in text */
+struct words {
+	struct buffer text;
+	size_t *offs;
+	char **argv;
+	size_t cap;
+};
+
+enum state { FREE, RUNNING, DONE };
+
+struct job {
+	enum state state;
+	unsigned long seq;
+	pid_t pid;
+	int fd; /* read end of the pipe capturing standard output, or -1 */
+	struct buffer out;
+};
+
+static void append(struct buffer *b, const char *s, size_t n) {
+	if (b->len + n + 1 > b->cap) {
+		b->cap = (b->len + n + 1) * 2;
+		b->data = (char *) realloc(b->data, b->cap);
+		if (b->data == TC_NULL) {
+			perror("malloc");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+}
+
+static void compile(struct template *t, int argc, char *argv[]) {
+	struct buffer cmd;
+	char *p, *q;
+	size_t n;
 	int i;
-	int j;
-	int k;
-	int n;
-	char *cmd;
-	char *result;
-	size_t len = 0;
 
 	/* combine argv into one string */
+	tc_memset(&cmd, '\0', sizeof(struct buffer));
+	append(&cmd, "", 0);
 	for (i = 0; i < argc; i++) {
-		len += tc_strlen(argv[i]) + 1;
+		append(&cmd, argv[i], tc_strlen(argv[i]));
+		if (i + 1 != argc) {
+			append(&cmd, " ", 1);
+		}
 	}
 
-	cmd = (char *) malloc(len + 1);
-	if (cmd == TC_NULL) {
+	t->nplaceholders = 0;
+	for (p = cmd.data; (p = strstr(p, "{}")) != TC_NULL; p += 2) {
+		t->nplaceholders++;
+	}
+
+	t->literals = (char **) malloc(sizeof(char *) * (t->nplaceholders + 1));
+	t->lens = (size_t *) malloc(sizeof(size_t) * (t->nplaceholders + 1));
+	if (t->literals == TC_NULL || t->lens == TC_NULL) {
 		perror("malloc");
 		tc_exit(TC_EXIT_FAILURE);
 	}
-	tc_memset(cmd, '\0', len + 1);
 
-	for (i = 0; i < argc; i++) {
-		strncat(cmd, argv[i], len);
-		if (i + 1 != argc) {
-			strncat(cmd, " ", len);
-		}
+	for (n = 0, p = cmd.data; n <= t->nplaceholders; n++, p = q + 2) {
+		q = strstr(p, "{}");
+		q = q == TC_NULL ? p + tc_strlen(p) : q;
+		t->literals[n] = p;
+		t->lens[n] = q - p;
+		*q = '\0';
 	}
 
-	tc_chomp(line);
-
-	/* find instances of {} and replace with line */
-	n = 0;
-	for (i = 0; i < tc_strlen(cmd); i++) {
-		if (cmd[i] == '{' && cmd[i+1] == '}') {
-			n++;
+	t->direct = 1;
+	for (n = 0; n <= t->nplaceholders; n++) {
+		if (strpbrk(t->literals[n], SHELL_CHARS) != TC_NULL) {
+			t->direct = 0;
 		}
 	}
 
-	len = tc_strlen(cmd) + (n * tc_strlen(cmd)) + 1;
-	result = (char *) malloc(len + 1);
-	if (result == TC_NULL) {
+	/* at most one literal and one blank per character, plus the placeholders */
+	t->nparts = 0;
+	t->parts = (struct part *) malloc(sizeof(struct part) * (cmd.len + t->nplaceholders + 1));
+	if (t->parts == TC_NULL) {
 		perror("malloc");
 		tc_exit(TC_EXIT_FAILURE);
 	}
-	tc_memset(result, '\0', len + 1);
-
-	/* i is index in cmd, j is index in result, k is index in line */
-	for (i = j = 0; i < tc_strlen(cmd); i++) {
-		if (cmd[i] == '{' && cmd[i+1] == '}') {
-			for (k = 0; k < tc_strlen(line); k++) {
-				result[j] = line[k];
-				j += 1;
+	for (n = 0; n <= t->nplaceholders; n++) {
+		for (p = t->literals[n]; *p != '\0'; p = q) {
+			q = p + strcspn(p, " \t");
+			if (q == p) {
+				t->parts[t->nparts].kind = BLANK;
+				q = p + strspn(p, " \t");
+			} else {
+				t->parts[t->nparts].kind = LITERAL;
 			}
-			i += 1; /* skip over '}' */
+			t->parts[t->nparts].text = p;
+			t->parts[t->nparts].len = q - p;
+			t->nparts++;
+		}
+		if (n < t->nplaceholders) {
+			t->parts[t->nparts].kind = PLACEHOLDER;
+			t->nparts++;
+		}
+	}
+}
+
+/* ends the word being built in w, if there is one */
+static void endword(struct words *w, size_t *start, size_t *n) {
+	if (w->text.len > *start) {
+		w->offs[(*n)++] = *start;
+		append(&w->text, "", 1);
+		*start = w->text.len;
+	}
+}
+
+/* fills in the argv a shell would get by splitting the expanded command
+ * on blanks; returns the number of words.
+ */
+static size_t fill(const struct template *t, const char *arg, size_t arglen, struct words *w) {
+	size_t i, k, n, start, need;
+	const char *p, *end;
+
+	need = t->nparts + t->nplaceholders * (arglen / 2 + 1) + 1;
+	if (need > w->cap) {
+		w->cap = need;
+		w->offs = (size_t *) realloc(w->offs, sizeof(size_t) * need);
+		w->argv = (char **) realloc(w->argv, sizeof(char *) * need);
+		if (w->offs == TC_NULL || w->argv == TC_NULL) {
+			perror("malloc");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+
+	w->text.len = 0;
+	start = n = 0;
+	for (i = 0; i < t->nparts; i++) {
+		if (t->parts[i].kind == LITERAL) {
+			append(&w->text, t->parts[i].text, t->parts[i].len);
+		} else if (t->parts[i].kind == BLANK) {
+			endword(w, &start, &n);
 		} else {
-			result[j] = cmd[i];
-			j += 1;
+			for (p = arg, end = arg + arglen; p < end; p += k) {
+				k = strcspn(p, " \t");
+				if (k == 0) {
+					endword(w, &start, &n);
+					k = 1;
+				} else {
+					append(&w->text, p, k);
+				}
+			}
 		}
 	}
+	endword(w, &start, &n);
+
+	for (i = 0; i < n; i++) {
+		w->argv[i] = w->text.data + w->offs[i];
+	}
+	w->argv[n] = TC_NULL;
+
+	return n;
+}
+
+/* substitutes arg for every {} */
+static void expand(const struct template *t, const char *arg, size_t arglen, struct buffer *cmd) {
+	size_t i;
+
+	cmd->len = 0;
+	for (i = 0; i < t->nplaceholders; i++) {
+		append(cmd, t->literals[i], t->lens[i]);
+		append(cmd, arg, arglen);
+	}
+	append(cmd, t->literals[i], t->lens[i]);
+}
+
+/* starts path (searched for in PATH when it has no /) with standard
+ * output on outfd unless it is -1.
+ */
+static pid_t spawn(const char *path, char **argv, int outfd) {
+	posix_spawn_file_actions_t actions, *ap;
+	pid_t pid;
+	int rc;
+
+	ap = TC_NULL;
+	if (outfd != -1) {
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, outfd, TC_STDOUT);
+		ap = &actions;
+	}
 
-	free(cmd);
-	cmd = TC_NULL;
+	rc = posix_spawnp(&pid, path, ap, TC_NULL, argv, environ);
 
-	system(result);
+	if (ap != TC_NULL) {
+		posix_spawn_file_actions_destroy(ap);
+	}
+
+	return rc == 0 ? pid : -1;
+}
+
+/* with -k a job's slot is fixed by its position in the input so output
+ * can be printed in order, otherwise any free slot will do.
+ */
+static struct job *free_slot(struct job *jobs, size_t nslots, unsigned long seq, int ordered) {
+	size_t i;
+
+	if (ordered) {
+		return jobs[seq % nslots].state == FREE ? &jobs[seq % nslots] : TC_NULL;
+	}
 
-	free(result);
-	result = TC_NULL;
+	for (i = 0; i < nslots; i++) {
+		if (jobs[i].state == FREE) {
+			return &jobs[i];
+		}
+	}
 
+	return TC_NULL;
 }
 
 int main(int argc, char *argv[]) {
 
-	int ch;
 	char *line;
-	size_t linecap;
+	size_t linecap, i, nrunning, nslots, batched;
 	ssize_t linelen;
+	long flag_P, flag_n;
+	int flag_k, capture, eof, status, fds[2];
+	unsigned long seq, next_out;
+	struct template t;
+	struct buffer arg_text, cmd;
+	struct job *jobs, *job;
+	struct pollfd pfds[MAXJOBS];
+	size_t pjob[MAXJOBS], npfds, nexiting;
+	pid_t *exiting;
+	char *sh[4];
+	struct words words;
+	ssize_t nread;
+	pid_t pid;
+	char buf[64 * 1024];
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'k', .longarg = "keep-order", .description = "print the output of parallel commands in input order", .has_value = 0 },
+		{ .arg = 'n', .longarg = "lines", .description = "number of lines to substitute for {} in each command", .has_value = 1 },
+		{ .arg = 'P', .longarg = "parallel", .description = "number of commands to run at once", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
@@ -114,6 +312,8 @@ int main(int argc, char *argv[]) {
 		{ .command = "ls -1 ../src | extract '(.*)\\.c$' '$1' | foreach -- '{} --help | ./head -n 1'", .description = "find all source files and remove the .c at the end to get the program names. execute each program with the `--help` argument and grab the first line of output. {} is the placeholder for standard input" },
 		{ .command = "ls -1 *.dat | foreach mv {} {}.done", .description = "rename files *.dat to *.dat.done {} is the placeholder for standard input" },
 		{ .command = "seq 1 10 | foreach d6", .description = "simulate 10 rolls of a 6 sided die" },
+		{ .command = "cat urls.txt | foreach -P 16 -k rest {}", .description = "fetch 16 urls at a time, printing the responses in input order" },
+		{ .command = "ls -1 *.log | foreach -P 4 -n 100 gzip {}", .description = "compress log files 100 at a time with 4 gzip processes" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -130,11 +330,27 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_k = 0;
+	flag_n = 1;
+	flag_P = 1;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'k':
+				flag_k = 1;
+				break;
+			case 'n':
+				flag_n = tc_atoi(argval);
+				flag_n = flag_n < 1 ? 1 : flag_n;
+				break;
+			case 'P':
+				flag_P = tc_atoi(argval);
+				flag_P = flag_P < 1 ? 1 : flag_P > MAXJOBS ? MAXJOBS : flag_P;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -145,12 +361,186 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
+	compile(&t, argc, argv);
+
+	/* parallel commands have their output collected so it isn't interleaved */
+	capture = flag_P > 1;
+	nslots = capture && flag_k ? flag_P * WINDOW : flag_P;
+	jobs = (struct job *) tc_malloc(sizeof(struct job) * nslots);
+	if (jobs == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	tc_memset(jobs, '\0', sizeof(struct job) * nslots);
+
+	/* commands that closed their output but haven't exited yet */
+	exiting = (pid_t *) tc_malloc(sizeof(pid_t) * nslots);
+	if (exiting == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	nexiting = 0;
+
+	tc_memset(&arg_text, '\0', sizeof(struct buffer));
+	tc_memset(&cmd, '\0', sizeof(struct buffer));
+	tc_memset(&words, '\0', sizeof(struct words));
 	line = TC_NULL;
 	linecap = 0;
+	eof = 0;
+	seq = next_out = 0;
+	nrunning = 0;
+
+	while (!eof || nrunning > 0) {
+
+		/* start commands while there is input and room */
+		while (!eof && nrunning < (size_t) flag_P && (job = free_slot(jobs, nslots, seq, flag_k)) != TC_NULL) {
+			arg_text.len = 0;
+			append(&arg_text, "", 0);
+			for (batched = 0; batched < (size_t) flag_n; batched++) {
+				linelen = getline(&line, &linecap, stdin);
+				if (linelen <= 0) {
+					eof = 1;
+					break;
+				}
+				tc_chomp(line);
+				if (batched > 0) {
+					append(&arg_text, " ", 1);
+				}
+				append(&arg_text, line, tc_strlen(line));
+			}
+			if (batched == 0) {
+				break;
+			}
+
+			job->seq = seq++;
+			job->fd = -1;
+			job->out.len = 0;
+			if (capture) {
+				if (pipe(fds) == -1) {
+					perror("pipe");
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+				fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			}
+			fflush(stdout);
+			/* without shell syntax, run it directly; otherwise, or if that fails, use /bin/sh */
+			job->pid = -1;
+			if (t.direct && strpbrk(arg_text.data, SHELL_CHARS) == TC_NULL && fill(&t, arg_text.data, arg_text.len, &words) > 0) {
+				job->pid = spawn(words.argv[0], words.argv, capture ? fds[1] : -1);
+			}
+			if (job->pid == -1) {
+				expand(&t, arg_text.data, arg_text.len, &cmd);
+				sh[0] = "sh";
+				sh[1] = "-c";
+				sh[2] = cmd.data;
+				sh[3] = TC_NULL;
+				job->pid = spawn("/bin/sh", sh, capture ? fds[1] : -1);
+			}
+			if (capture) {
+				close(fds[1]);
+				job->fd = fds[0];
+			}
+			if (job->pid == -1) {
+				perror("posix_spawn");
+				if (job->fd != -1) {
+					close(job->fd);
+					job->fd = -1;
+				}
+				job->state = DONE;
+			} else {
+				job->state = RUNNING;
+				nrunning++;
+			}
+		}
+
+		if (nrunning > 0 && !capture) {
+			/* output goes straight to ours, just reap */
+			if ((pid = waitpid(-1, &status, 0)) > 0) {
+				for (i = 0; i < nslots; i++) {
+					if (jobs[i].state == RUNNING && jobs[i].pid == pid) {
+						jobs[i].state = FREE;
+						nrunning--;
+					}
+				}
+			}
+		} else if (nrunning > 0) {
+			npfds = 0;
+			for (i = 0; i < nslots; i++) {
+				if (jobs[i].state == RUNNING) {
+					pfds[npfds].fd = jobs[i].fd;
+					pfds[npfds].events = POLLIN;
+					pjob[npfds] = i;
+					npfds++;
+				}
+			}
+			/* check back on exiting commands now and then rather than block on them */
+			if (poll(pfds, npfds, nexiting > 0 ? 10 : -1) == -1 && errno != EINTR) {
+				perror("poll");
+				tc_exit(TC_EXIT_FAILURE);
+			}
+			for (i = 0; i < npfds; i++) {
+				if (pfds[i].revents == 0) {
+					continue;
+				}
+				job = &jobs[pjob[i]];
+				nread = read(job->fd, buf, sizeof(buf));
+				if (nread > 0) {
+					append(&job->out, buf, nread);
+				} else if (nread == 0 || errno != EINTR) {
+					/* output closed, the command is finishing */
+					close(job->fd);
+					job->fd = -1;
+					job->state = DONE;
+					if (waitpid(job->pid, &status, WNOHANG) == 0) {
+						exiting[nexiting++] = job->pid;
+					} else {
+						nrunning--;
+					}
+				}
+			}
+
+			for (i = 0; i < nexiting; ) {
+				if (waitpid(exiting[i], &status, WNOHANG) != 0) {
+					exiting[i] = exiting[--nexiting];
+					nrunning--;
+				} else {
+					i++;
+				}
+			}
+		}
+
+		/* print finished output, in input order with -k */
+		for (i = 0; capture && i < nslots; i++) {
+			job = flag_k ? &jobs[next_out % nslots] : &jobs[i];
+			if (job->state != DONE || (flag_k && job->seq != next_out)) {
+				if (flag_k) {
+					break;
+				}
+				continue;
+			}
+			fwrite(job->out.data, 1, job->out.len, stdout);
+			job->state = FREE;
+			next_out++;
+		}
+		for (i = 0; !capture && i < nslots; i++) {
+			if (jobs[i].state == DONE) {
+				jobs[i].state = FREE;
+			}
+		}
+	}
 
-	while ((linelen = getline(&line, &linecap, stdin)) > 0) {
-		foreach(argc, argv, line);
+	for (i = 0; i < nslots; i++) {
+		free(jobs[i].out.data);
 	}
+	jobs = tc_free(jobs);
+	exiting = tc_free(exiting);
+	free(words.text.data);
+	free(words.offs);
+	free(words.argv);
+	free(t.parts);
+	free(arg_text.data);
+	free(cmd.data);
 
 	if (line != TC_NULL) {
 		free(line);
@@ -21,34 +21,219 @@
 #include <tc/tc.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#define ROWSZ 16
+#define ROWMAX 96 /* longest possible rendered row */
+#define OUTSZ (256 * 1024)
+#define INSZ (1024 * 1024) /* a whole number of rows */
+
+static char hex[256][3];   /* "xx " for every byte value */
+static char shown[256];    /* the character shown in the text column */
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static void init_tables(void) {
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		hex[i][0] = digits[i >> 4];
+		hex[i][1] = digits[i & 0xf];
+		hex[i][2] = ' ';
+		shown[i] = (i >= 0x20 && i < 0x7f) ? (char) i : '.';
+	}
+}
+
+static void flush(void) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < outlen; off += n) {
+		n = write(TC_STDOUT, out + off, outlen - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	outlen = 0;
+}
+
+/* renders one row, padding a short final row with zero bytes */
+static void row(const unsigned char *bytes, size_t n, unsigned long addr) {
+	static const char digits[] = "0123456789abcdef";
+	unsigned char padded[ROWSZ];
+	unsigned long a;
+	char *p;
+	int i, width;
+
+	if (n < ROWSZ) {
+		tc_memset(padded, '\0', ROWSZ);
+		memcpy(padded, bytes, n);
+		bytes = padded;
+	}
+
+	if (outlen + ROWMAX > OUTSZ) {
+		flush();
+	}
+	p = out + outlen;
+
+	for (width = 8, a = addr >> 32; a != 0; a >>= 4) {
+		width++;
+	}
+	for (i = width - 1; i >= 0; i--, addr >>= 4) {
+		p[i] = digits[addr & 0xf];
+	}
+	p += width;
+	*p++ = ' ';
+	*p++ = ' ';
+
+	for (i = 0; i < ROWSZ; i++) {
+		memcpy(p, hex[bytes[i]], 3);
+		p += 3;
+		if (i % 8 == 7) {
+			*p++ = ' ';
+		}
+	}
+
+	*p++ = '|';
+	for (i = 0; i < ROWSZ; i++) {
+		*p++ = shown[bytes[i]];
+	}
+	*p++ = '|';
+	*p++ = '\n';
+
+	outlen = p - out;
+}
+
+static void dump(const unsigned char *data, size_t len, unsigned long addr) {
+	size_t i;
+
+	for (i = 0; i < len; i += ROWSZ) {
+		row(data + i, len - i < ROWSZ ? len - i : ROWSZ, addr + i);
+	}
+}
+
+/* fills buf unless EOF comes first, returns the number of bytes read */
+static size_t fill(int fd, unsigned char *buf, size_t len) {
+	size_t total;
+	ssize_t n;
+
+	for (total = 0; total < len; total += n) {
+		n = read(fd, buf + total, len - total);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n == -1) {
+			perror("read");
+			tc_exit(TC_EXIT_FAILURE);
+		} else if (n == 0) {
+			break;
+		}
+	}
+	return total;
+}
+
+/* regular files are mapped and dumped straight from the page cache */
+static int dump_mapped(int fd, unsigned long offset, long length) {
+	struct stat st;
+	unsigned long start, end;
+	long pagesz;
+	size_t skew;
+	unsigned char *map;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		return TC_ERR;
+	}
+
+	end = length >= 0 && offset + length < (unsigned long) st.st_size ? offset + length : (unsigned long) st.st_size;
+	if (offset >= end) {
+		return TC_OK;
+	}
+
+	pagesz = sysconf(_SC_PAGESIZE);
+	start = offset - offset % pagesz;
+	skew = offset - start;
+	map = mmap(TC_NULL, end - start, PROT_READ, MAP_PRIVATE, fd, start);
+	if (map == MAP_FAILED) {
+		return TC_ERR;
+	}
+	madvise(map, end - start, MADV_SEQUENTIAL);
+
+	dump(map + skew, end - offset, offset);
+
+	munmap(map, end - start);
+	return TC_OK;
+}
+
+static void dump_stream(int fd, unsigned long offset, long length) {
+	unsigned char *buf;
+	unsigned long addr;
+	size_t n, want;
+
+	buf = (unsigned char *) tc_malloc(INSZ);
+	if (buf == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	/* skip to the offset, by reading if the input can't seek */
+	if (offset > 0 && lseek(fd, offset, SEEK_CUR) == -1) {
+		for (addr = 0; addr < offset; addr += n) {
+			n = fill(fd, buf, offset - addr < INSZ ? offset - addr : INSZ);
+			if (n == 0) {
+				break;
+			}
+		}
+	}
+
+	for (addr = offset; length != 0; addr += n) {
+		want = length >= 0 && (unsigned long) length < INSZ ? (size_t) length : INSZ;
+		n = fill(fd, buf, want);
+		if (n == 0) {
+			break;
+		}
+		dump(buf, n, addr);
+		length -= length >= 0 ? (long) n : 0;
+	}
+
+	buf = tc_free(buf);
+}
+
 int main(int argc, char *argv[]) {
 
-	FILE *f;
-	char bytes[16];
-	int i, j;
-	size_t n, addr;
+	int fd;
+	unsigned long offset;
+	long length;
+	char *end;
 
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'n', .longarg = "length", .description = "number of bytes to show", .has_value = 1 },
+		{ .arg = 's', .longarg = "skip", .description = "offset of the first byte to show", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "hexdump foo.bin", .description = "show file contents as hex value" },
+		{ .command = "hexdump -s 0x1000 -n 256 core", .description = "show 256 bytes starting at offset 4096" },
+		{ .command = "head -c 64 /dev/urandom | hexdump", .description = "show standard input as hex values" },
 		TC_PROG_EXAMPLE_END
 	};
 
 	static struct tc_prog prog = {
 		.program = "hexdump",
-		.usage = "[OPTIONS] FILE",
+		.usage = "[OPTIONS] [FILE]",
 		.description = "prints the contents of a file in hexadecimal",
 		.package = TC_VERSION_NAME,
 		.version = TC_VERSION_STRING,
@@ -59,11 +244,29 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	offset = 0;
+	length = -1; /* until EOF */
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'n':
+				length = strtol(argval, &end, 0);
+				if (*end != '\0' || length < 0) {
+					tc_args_show_usage(&prog);
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				offset = strtoul(argval, &end, 0);
+				if (*end != '\0' || argval[0] == '-') {
+					tc_args_show_usage(&prog);
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -74,42 +277,29 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	if (argc != 1) {
+	if (argc > 1) {
 		tc_args_show_usage(&prog);
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	f = fopen(argv[0], "rb");
-	if (f == TC_NULL) {
-		perror("fopen");
-		tc_exit(TC_EXIT_FAILURE);
+	fd = TC_STDIN;
+	if (argc == 1 && !tc_streql(argv[0], "-")) {
+		fd = open(argv[0], O_RDONLY);
+		if (fd == -1) {
+			perror("open");
+			tc_exit(TC_EXIT_FAILURE);
+		}
 	}
 
-	addr = 0;
-	do {
-		tc_memset(bytes, '\0', sizeof(char) * 16);
-		n = fread(bytes, sizeof(char), 16, f);
-		if (n == 0) {
-			break;
-		}
-		printf("%.8lx  ", addr);
-		for (i = 0; i < 2; i++) {
-			for (j = 0; j < 8; j++) {
-				printf("%.2x", 0xff & bytes[(i*8)+j]);
-				printf(" ");
-			}
-			printf(" ");
-		}
-		printf("|");
-		for (i = 0; i < 16; i++) {
-			printf("%c", tc_isprint(bytes[i]) ? bytes[i] : '.');
-		}
-		printf("|");
-		printf("\n");
-		addr+=n;
-	} while (1);
+	init_tables();
+	if (dump_mapped(fd, offset, length) != TC_OK) {
+		dump_stream(fd, offset, length);
+	}
+	flush();
 
-	fclose(f);
+	if (fd != TC_STDIN) {
+		close(fd);
+	}
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
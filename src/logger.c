@@ -18,17 +18,213 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <tc/tc.h>
 
+#include <errno.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MSGSZ 2048
-#define USAGE "[-h] [-v] [-i] [-s] [-c] [-t tag] MESSAGE..."
+#define BATCH 64
+#define USAGE "[-h] [-v] [-i] [-s] [-c] [-d] [-f file] [-t tag] [-u socket] [MESSAGE...]"
+
+/* a connection to the syslog socket and the records waiting to go out on it */
+struct sink {
+	const char *path;
+	int fd;
+	int type;
+	int drop;
+	unsigned long long dropped;
+	char records[BATCH][MSGSZ];
+	size_t lens[BATCH];
+	int n;
+};
+
+static int sink_connect(struct sink *s) {
+
+	int i;
+	struct sockaddr_un addr;
+	static const int types[] = { SOCK_DGRAM, SOCK_STREAM };
+
+	tc_memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (tc_strlen((char *) s->path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return TC_ERR;
+	}
+	strcpy(addr.sun_path, s->path);
+
+	/* /dev/log is usually a datagram socket, but some daemons use a stream */
+	for (i = 0; i < 2; i++) {
+		s->fd = socket(AF_UNIX, types[i], 0);
+		if (s->fd == -1) {
+			return TC_ERR;
+		}
+		if (connect(s->fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+			s->type = types[i];
+			return TC_OK;
+		}
+		close(s->fd);
+		s->fd = -1;
+		if (errno != EPROTOTYPE) {
+			break;
+		}
+	}
+
+	return TC_ERR;
+}
+
+/* sends one record; on a stream a partial send is finished even if that
+ * means waiting, a half record would break the framing for the rest.
+ */
+static int send_record(struct sink *s, const char *record, size_t len, int flags) {
+
+	ssize_t n;
+	size_t off;
+
+	n = send(s->fd, record, len, flags);
+	if (n == -1) {
+		return -1;
+	}
+	for (off = n; off < len; off += n) {
+		n = send(s->fd, record + off, len - off, 0);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* sends records first through n - 1, returns how many went out or -1 */
+static int sink_send(struct sink *s, int first, int n) {
+
+	int i, rc, flags;
+#if defined(__linux__)
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+#endif
+
+	flags = s->drop ? MSG_DONTWAIT : 0;
+
+#if defined(__linux__)
+	/* whole datagrams either go or don't, so they can be batched */
+	if (s->type == SOCK_DGRAM) {
+		tc_memset(msgs, '\0', sizeof(msgs));
+		for (i = first; i < n; i++) {
+			iov[i].iov_base = s->records[i];
+			iov[i].iov_len = s->lens[i];
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		return sendmmsg(s->fd, msgs + first, n - first, flags);
+	}
+#endif
+
+	for (i = first, rc = 0; i < n; i++, rc++) {
+		if (send_record(s, s->records[i], s->lens[i], flags) == -1) {
+			if (rc == 0) {
+				rc = -1;
+			}
+			break;
+		}
+	}
+
+	return rc;
+}
+
+/* sends everything queued. when the socket is full this waits, or with
+ * -d drops the rest of the batch and counts it.
+ */
+static void sink_flush(struct sink *s) {
+
+	int sent, rc, retried;
+	struct pollfd pfd;
+
+	retried = 0;
+	for (sent = 0; sent < s->n; ) {
+		rc = sink_send(s, sent, s->n);
+		if (rc > 0) {
+			sent += rc;
+		} else if (errno == EINTR) {
+			continue;
+		} else if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) && s->drop) {
+			s->dropped += s->n - sent;
+			break;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			/* full, give the daemon a moment to catch up and try again */
+			pfd.fd = s->fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 10);
+		} else if (!retried && (errno == ECONNREFUSED || errno == ENOTCONN || errno == EPIPE)) {
+			/* the syslog daemon restarted, reconnect once */
+			retried = 1;
+			close(s->fd);
+			if (sink_connect(s) != TC_OK) {
+				perror(s->path);
+				tc_exit(TC_EXIT_FAILURE);
+			}
+		} else {
+			perror(s->path);
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+
+	s->n = 0;
+}
+
+/* formats an RFC 5424 record into the next free slot */
+static void sink_add(struct sink *s, int pri, const char *hostname, const char *tag, const char *procid, const char *msg, size_t msglen) {
+
+	static time_t cachedsec = -1;
+	static char cachedtime[64];
+	static size_t cachedlen;
+	struct timespec now;
+	struct tm utc;
+	char *p;
+	size_t len, room;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec != cachedsec) {
+		gmtime_r(&now.tv_sec, &utc);
+		cachedlen = strftime(cachedtime, sizeof(cachedtime), "%Y-%m-%dT%H:%M:%S", &utc);
+		cachedsec = now.tv_sec;
+	}
+
+	p = s->records[s->n];
+	len = snprintf(p, MSGSZ, "<%d>1 %.*s.%06ldZ %s %s %s - - ", pri, (int) cachedlen, cachedtime, now.tv_nsec / 1000, hostname, tag, procid);
+	len = len >= MSGSZ ? MSGSZ - 1 : len;
+
+	/* leave room for the NUL that ends records on a stream socket */
+	room = MSGSZ - 1 - len;
+	msglen = msglen > room ? room : msglen;
+	memcpy(p + len, msg, msglen);
+	len += msglen;
+	if (s->type == SOCK_STREAM) {
+		p[len++] = '\0';
+	}
+	s->lens[s->n++] = len;
+
+	if (s->n == BATCH) {
+		sink_flush(s);
+	}
+}
 
 int main(int argc, char *argv[]) {
 
@@ -40,6 +236,16 @@ int main(int argc, char *argv[]) {
 	int facility;
 	int level;
 	char message[MSGSZ];
+	char *flag_f;
+	char *flag_u;
+	int flag_d;
+	FILE *input;
+	char *line;
+	size_t linecap;
+	ssize_t linelen;
+	char hostname[256];
+	char procid[32];
+	static struct sink sink;
 
 	static struct option long_options[] = {
 		{ "help", no_argument, 0, 'h' },
@@ -53,12 +259,21 @@ int main(int argc, char *argv[]) {
 	facility = LOG_USER;
 	level = LOG_INFO;
 	message[0] = '\0';
+	flag_d = 0;
+	flag_f = TC_NULL;
+	flag_u = TC_NULL;
 
-	while ((ch = getopt_long(argc, argv, "chist:V", long_options, TC_NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "cdf:hist:u:V", long_options, TC_NULL)) != -1) {
 		switch (ch) {
 			case 'c':
 				logopt |= LOG_CONS;
 				break;
+			case 'd':
+				flag_d = 1;
+				break;
+			case 'f':
+				flag_f = optarg;
+				break;
 			case 'i':
 				logopt |= LOG_PID;
 				break;
@@ -68,22 +283,31 @@ int main(int argc, char *argv[]) {
 			case 't':
 				tag = optarg;
 				break;
+			case 'u':
+				flag_u = optarg;
+				break;
 			case 'h':
     				fprintf(stdout, "logger -- add an entry in the system logs\n");
 				fprintf(stdout, "\n");
-				fprintf(stdout, "usage: logger [OPTIONS] MESSAGE...\n");
+				fprintf(stdout, "usage: logger [OPTIONS] [MESSAGE...]\n");
 				fprintf(stdout, "\n");
 				fprintf(stdout, "  -c             print the log message to the system console\n");
+				fprintf(stdout, "  -d             drop lines when the log socket is full instead of waiting\n");
+				fprintf(stdout, "  -f file        log each line of file (- or no MESSAGE for STDIN)\n");
 				fprintf(stdout, "  -h, --help     print help text\n");
 				fprintf(stdout, "  -i             include PID with the log message\n");
 				fprintf(stdout, "  -s             print the log message to STDERR as well\n");
 				fprintf(stdout, "  -t tag         identifier prepended to the log message\n");
+				fprintf(stdout, "  -u socket      log to this unix socket instead of /dev/log\n");
 				fprintf(stdout, "  -V, --version  print version and copyright info\n");
 				fprintf(stdout, "\n");
 				fprintf(stdout, "examples:\n");
 				fprintf(stdout, "\n");
 				fprintf(stdout, "  # log an application error for foobard, including PID\n");
 				fprintf(stdout, "  logger -i -t foobard 'failed to authenticate user Alice'\n");
+				fprintf(stdout, "\n");
+				fprintf(stdout, "  # log the output of a batch job, one entry per line\n");
+				fprintf(stdout, "  nightly-backup 2>&1 | logger -t backup\n");
 				tc_exit(TC_EXIT_SUCCESS);
 				break;
 			case 'V':
@@ -107,33 +331,98 @@ int main(int argc, char *argv[]) {
 	argc -= optind;
 	argv += optind;
 
-	if (argc == 0) {
-		fprintf(stderr, "usage: logger [OPTIONS] MESSAGE...\n");
-		tc_exit(TC_EXIT_FAILURE);
-	}
-
-	tc_memset(message, '\0', MSGSZ);
-	msgsize = 1 /* NUL byte */;
-	for (i = 0; i < argc; i++) {
-		msgsize += tc_strlen(argv[i]);
-		if (msgsize >= MSGSZ) {
-			fprintf(stderr, "Message too long\n");
+	input = TC_NULL;
+	if (argc == 0 || flag_f != TC_NULL) {
+		/* no message, log the lines of a file or standard input */
+		if (argc != 0) {
+			fprintf(stderr, "usage: logger %s\n", USAGE);
 			tc_exit(TC_EXIT_FAILURE);
 		}
-		strncat(message, argv[i], MSGSZ - msgsize);
-		if (i + 1 < argc) {
-			msgsize += 1;
+
+		input = stdin;
+		if (flag_f != TC_NULL && strcmp(flag_f, "-") != 0) {
+			input = fopen(flag_f, "r");
+			if (input == TC_NULL) {
+				perror(flag_f);
+				tc_exit(TC_EXIT_FAILURE);
+			}
+		}
+	} else {
+		tc_memset(message, '\0', MSGSZ);
+		msgsize = 1 /* NUL byte */;
+		for (i = 0; i < argc; i++) {
+			msgsize += tc_strlen(argv[i]);
 			if (msgsize >= MSGSZ) {
 				fprintf(stderr, "Message too long\n");
 				tc_exit(TC_EXIT_FAILURE);
 			}
-			strncat(message, " ", MSGSZ - msgsize);
+			strncat(message, argv[i], MSGSZ - msgsize);
+			if (i + 1 < argc) {
+				msgsize += 1;
+				if (msgsize >= MSGSZ) {
+					fprintf(stderr, "Message too long\n");
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				strncat(message, " ", MSGSZ - msgsize);
+			}
+		}
+
+		if (flag_u == TC_NULL) {
+			openlog(tag, logopt, facility);
+			syslog(level, "%s", message);
+			closelog();
+
+			tc_exit(TC_EXIT_SUCCESS);
 		}
 	}
 
-	openlog(tag, logopt, facility);
-	syslog(level, "%s", message);
-	closelog();
+	/* lines are sent over one connection rather than one syslog() call each */
+	sink.path = flag_u != TC_NULL ? flag_u : "/dev/log";
+	sink.drop = flag_d;
+	if (sink_connect(&sink) != TC_OK) {
+		perror(sink.path);
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	if (gethostname(hostname, sizeof(hostname)) == -1 || hostname[0] == '\0') {
+		strcpy(hostname, "-");
+	}
+	hostname[sizeof(hostname) - 1] = '\0';
+	if (logopt & LOG_PID) {
+		snprintf(procid, sizeof(procid), "%ld", (long) getpid());
+	} else {
+		strcpy(procid, "-");
+	}
+	tag = tag == TC_NULL ? "-" : tag;
+
+	if (input == TC_NULL) {
+		if (logopt & LOG_PERROR) {
+			fprintf(stderr, "%s: %s\n", tag, message);
+		}
+		sink_add(&sink, facility | level, hostname, tag, procid, message, tc_strlen(message));
+	} else {
+		line = TC_NULL;
+		linecap = 0;
+		while ((linelen = getline(&line, &linecap, input)) > 0) {
+			if (line[linelen - 1] == '\n') {
+				line[--linelen] = '\0';
+			}
+			if (logopt & LOG_PERROR) {
+				fprintf(stderr, "%s: %s\n", tag, line);
+			}
+			sink_add(&sink, facility | level, hostname, tag, procid, line, linelen);
+		}
+		free(line);
+		if (input != stdin) {
+			fclose(input);
+		}
+	}
+	sink_flush(&sink);
+	close(sink.fd);
+
+	if (sink.dropped > 0) {
+		fprintf(stderr, "logger: dropped %llu messages\n", sink.dropped);
+	}
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
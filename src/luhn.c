@@ -20,14 +20,201 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCKSZ (128 * 1024)
+#define OUTSZ (256 * 1024)
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* which bytes of a little endian load sit at even and odd offsets */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define EVENS 0xff00ff00ff00ff00ULL
+#define ODDS 0x00ff00ff00ff00ffULL
+#else
+#define EVENS 0x00ff00ff00ff00ffULL
+#define ODDS 0xff00ff00ff00ff00ULL
+#endif
+
+/* pair[10 * x + y] is the luhn sum of "xy" where x is doubled */
+static unsigned char pair[100];
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static unsigned long nok = 0;
+static unsigned long nbad = 0;
+
+static void output(const char *s, size_t len) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < len; off += n) {
+		n = write(TC_STDOUT, s + off, len - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+}
+
+static void flush(void) {
+	output(out, outlen);
+	outlen = 0;
+}
+
+static void append(const char *s, size_t len) {
+	if (outlen + len > OUTSZ) {
+		flush();
+	}
+	if (len > OUTSZ) {
+		output(s, len);
+		return;
+	}
+	memcpy(out + outlen, s, len);
+	outlen += len;
+}
+
+static void init(void) {
+	int x, y;
+
+	for (x = 0; x < 10; x++) {
+		for (y = 0; y < 10; y++) {
+			pair[10 * x + y] = (unsigned char) ((x < 5 ? 2 * x : 2 * x - 9) + y);
+		}
+	}
+}
+
+/* same answer as tc_luhn_check(), 8 digits at a time */
+static int check(const char *s, size_t len) {
+	tc_uint64_t v, d, dbl;
+	unsigned sum = 0;
+	size_t i, odd;
+
+	if (len < 2) {
+		return 0;
+	}
+
+	/* digits an odd distance from the last one get doubled */
+	odd = (len - 1) % 2;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, s + i, 8);
+		/* every byte must be '0'..'9' */
+		if ((v | ~(v + ONES * (0x80 - '0')) | (v + ONES * (0x80 - ':'))) & HIGHS) {
+			return 0;
+		}
+		d = v - ONES * '0';
+		dbl = d & (odd ? EVENS : ODDS);
+		/* 2d, less 9 when d >= 5 */
+		d = d + dbl - 9 * (((dbl + ONES * 3) >> 3) & ONES);
+		sum += (unsigned) ((d * ONES) >> 56);
+	}
+	if ((len - i) % 2 == 1) {
+		if ((unsigned) (s[i] - '0') > 9) {
+			return 0;
+		}
+		sum += (unsigned) (s[i] - '0');
+		i++;
+	}
+	for (; i < len; i += 2) {
+		if ((unsigned) (s[i] - '0') > 9 || (unsigned) (s[i + 1] - '0') > 9) {
+			return 0;
+		}
+		sum += pair[10 * (s[i] - '0') + (s[i + 1] - '0')];
+	}
+
+	return sum % 10 == 0;
+}
+
+static void result(const char *s, size_t len, int ok, int summary) {
+	if (ok) {
+		nok++;
+	} else {
+		nbad++;
+	}
+	if (!summary) {
+		append(s, len);
+		append(ok ? "\tOK\n" : "\tBAD\n", ok ? 4 : 5);
+	}
+}
+
+/* checks one number per line, blank lines are skipped */
+static void stream(int fd, int summary) {
+	char *buf, *p, *end, *nl;
+	size_t cap = BLOCKSZ, have = 0, len;
+	ssize_t nread;
+
+	buf = (char *) malloc(cap);
+	if (buf == TC_NULL) {
+		tc_puterrln("Out of memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	do {
+		if (have == cap) {
+			cap *= 2;
+			buf = (char *) realloc(buf, cap);
+			if (buf == TC_NULL) {
+				tc_puterrln("Out of memory");
+				tc_exit(TC_EXIT_FAILURE);
+			}
+		}
+		do {
+			nread = read(fd, buf + have, cap - have);
+		} while (nread == -1 && errno == EINTR);
+		if (nread == -1) {
+			tc_puterrln("Read Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+		have += (size_t) nread;
+		end = buf + have;
+
+		for (p = buf; p < end; p = nl + 1) {
+			nl = memchr(p, '\n', (size_t) (end - p));
+			if (nl == TC_NULL) {
+				if (nread > 0) {
+					break;
+				}
+				nl = end; /* last line has no newline */
+			}
+			len = (size_t) (nl - p);
+			if (len > 0 && p[len - 1] == '\r') {
+				len--;
+			}
+			if (len > 0) {
+				result(p, len, check(p, len), summary);
+			}
+		}
+		if (p > end) {
+			p = end;
+		}
+		have = (size_t) (end - p);
+		memmove(buf, p, have);
+	} while (nread > 0);
+
+	free(buf);
+}
+
 int main(int argc, char *argv[]) {
 
 	int i;
-	int failure;
+	int summary;
+	int fd;
+	char *file;
+	char line[64];
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
+		{ .arg = 'f', .longarg = "file", .description = "check each line of FILE ('-' for stdin)", .has_value = 1 },
 		TC_PROG_ARG_HELP,
+		{ .arg = 's', .longarg = "summary", .description = "only print the number of OK and BAD", .has_value = 0 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
@@ -35,6 +222,8 @@ int main(int argc, char *argv[]) {
 	static struct tc_prog_example examples[] = {
 		{ .command = "luhn 4030000010001234", .description = "check the luhn of a string of digits" },
 		{ .command = "luhn 4030000010001234 4003050500040005 5100000010001004", .description = "check several at once" },
+		{ .command = "luhn -s < cards.txt", .description = "count valid and invalid numbers, one per line" },
+		{ .command = "luhn -f cards.txt | grep BAD", .description = "list the invalid numbers in a file" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -51,8 +240,18 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	file = TC_NULL;
+	summary = 0;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'f':
+				file = argval;
+				break;
+			case 's':
+				summary = 1;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
@@ -66,19 +265,30 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	failure = 0;
-	for (i = 0; i < argc; i++) {
-		tc_puts(TC_STDOUT, argv[i]);
-		tc_puts(TC_STDOUT, "\t");
+	init();
 
-		if (tc_luhn_check(argv[i])) {
-			tc_puts(TC_STDOUT, "OK\n");
-		} else {
-			tc_puts(TC_STDOUT, "BAD\n");
-			failure = 1;
+	for (i = 0; i < argc; i++) {
+		result(argv[i], tc_strlen(argv[i]), tc_luhn_check(argv[i]), summary);
+	}
 
+	if (file != TC_NULL && !tc_streql(file, "-")) {
+		fd = tc_open_reader(file);
+		if (fd == -1) {
+			tc_puterr("Could not open file: ");
+			tc_puterrln(file);
+			tc_exit(TC_EXIT_FAILURE);
 		}
+		stream(fd, summary);
+		tc_close(fd);
+	} else if (file != TC_NULL || argc == 0) {
+		stream(TC_STDIN, summary);
+	}
+
+	if (summary) {
+		snprintf(line, sizeof(line), "OK\t%lu\nBAD\t%lu\n", nok, nbad);
+		append(line, tc_strlen(line));
 	}
+	flush();
 
-	tc_exit(failure == 0 ? TC_EXIT_SUCCESS : TC_EXIT_FAILURE);
+	tc_exit(nbad == 0 ? TC_EXIT_SUCCESS : TC_EXIT_FAILURE);
 }
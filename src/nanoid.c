@@ -18,21 +18,133 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
+
+#define ALPHABET "_-0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define SIZE 21
+#define MAXSIZE 4096
+
+#define ENTROPYSZ (64 * 1024)
+#define OUTSZ (256 * 1024)
+
+static tc_uint8_t entropy[ENTROPYSZ];
+static size_t entropy_used = ENTROPYSZ;
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static void refill(void) {
+	ssize_t got;
+	size_t off;
+#if !defined(__linux__)
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1) {
+		tc_exit(TC_EXIT_FAILURE);
+	}
+#endif
+
+	for (off = 0; off < ENTROPYSZ; off += got) {
+#if defined(__linux__)
+		got = getrandom(entropy + off, ENTROPYSZ - off, 0);
+#else
+		got = read(fd, entropy + off, ENTROPYSZ - off);
+#endif
+		if (got == -1 && errno == EINTR) {
+			got = 0;
+		} else if (got <= 0) {
+			tc_puterrln("nanoid: cannot read random bytes");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+
+#if !defined(__linux__)
+	close(fd);
+#endif
+	entropy_used = 0;
+}
+
+static void flush(void) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < outlen; off += n) {
+		n = write(TC_STDOUT, out + off, outlen - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	outlen = 0;
+}
+
+/* writes size characters picked uniformly from alphabet. each random
+ * byte is masked to the smallest power of two covering the alphabet and
+ * rejected if it falls past the end, so there is no modulo bias.
+ */
+static void generate(const char *alphabet, size_t len, unsigned mask, size_t size) {
+	char *p, *end;
+	unsigned i;
+
+	if (outlen + size + 1 > OUTSZ) {
+		flush();
+	}
+
+	p = out + outlen;
+	end = p + size;
+	while (p < end) {
+		if (entropy_used == ENTROPYSZ) {
+			refill();
+		}
+		i = entropy[entropy_used++] & mask;
+		if (i < len) {
+			*p++ = alphabet[i];
+		}
+	}
+	*p++ = '\n';
+	outlen = p - out;
+}
+
 int main(int argc, char *argv[]) {
 
-	char *nanoid;
+	long long flag_n;
+	long long n;
+	int flag_s;
+	char *flag_a;
+	size_t len;
+	unsigned mask;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
+		{ .arg = 'a', .longarg = "alphabet", .description = "characters to build IDs from (default A-Za-z0-9_-)", .has_value = 1 },
 		TC_PROG_ARG_HELP,
+		{ .arg = 'n', .longarg = "count", .description = "number of IDs to generate (default 1)", .has_value = 1 },
+		{ .arg = 's', .longarg = "size", .description = "length of each ID (default 21)", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "nanoid", .description = "show a new nanoid" },
+		{ .command = "nanoid -n 1000000 > ids.txt", .description = "generate a million nanoids" },
+		{ .command = "nanoid -s 8 -a 0123456789abcdef", .description = "show an 8 digit hexadecimal ID" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -49,11 +161,25 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_a = ALPHABET;
+	flag_n = 1;
+	flag_s = SIZE;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'a':
+				flag_a = argval;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'n':
+				flag_n = strtoll(argval, TC_NULL, 10);
+				break;
+			case 's':
+				flag_s = tc_atoi(argval);
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -64,16 +190,24 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-
-	nanoid = tc_nanoid();
-	if (nanoid == TC_NULL) {
-		tc_puterrln("tc_nanoid() failed");
+	len = tc_strlen(flag_a);
+	if (len < 2 || len > 256) {
+		tc_puterrln("nanoid: alphabet must have between 2 and 256 characters");
+		tc_exit(TC_EXIT_FAILURE);
+	} else if (flag_s < 1 || flag_s > MAXSIZE) {
+		tc_puterrln("nanoid: size must be between 1 and 4096");
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	tc_putln(TC_STDOUT, nanoid);
+	for (mask = 1; mask < len - 1; mask = (mask << 1) | 1) {
+		;
+	}
+
+	for (n = 0; n < flag_n; n++) {
+		generate(flag_a, len, mask, flag_s);
+	}
 
-	nanoid = tc_free(nanoid);
+	flush();
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
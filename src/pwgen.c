@@ -20,27 +20,176 @@
 
 #include <tc/tc.h>
 
-static const int alphabet_size = 0x40;
-static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-"
+#define MAXLEN 4096
+#define NCLASSES 4
+#define LANES 8
+#define RANDSZ (64 * LANES * 16)
+#define OUTSZ (256 * 1024)
+
+/* ChaCha20 keystream generator, LANES blocks are computed side by side so
+ * the round function vectorizes.
+ */
+struct chacha {
+	tc_uint32_t key[8];
+	tc_uint32_t nonce[2];
+	tc_uint64_t counter;
+};
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void quarter(tc_uint32_t x[16][LANES], int a, int b, int c, int d) {
+	int l;
+
+	for (l = 0; l < LANES; l++) {
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL(x[d][l], 16);
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL(x[b][l], 12);
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL(x[d][l], 8);
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL(x[b][l], 7);
+	}
+}
+
+/* len must be a multiple of 64 * LANES */
+static void chacha_fill(struct chacha *cc, tc_uint8_t *out, size_t len) {
+	static const tc_uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+	tc_uint32_t in[16][LANES], x[16][LANES], w;
+	size_t off;
+	int i, l, r;
+
+	for (off = 0; off < len; off += 64 * LANES) {
+		for (l = 0; l < LANES; l++) {
+			for (i = 0; i < 4; i++) {
+				in[i][l] = sigma[i];
+			}
+			for (i = 0; i < 8; i++) {
+				in[4+i][l] = cc->key[i];
+			}
+			in[12][l] = (tc_uint32_t) (cc->counter + l);
+			in[13][l] = (tc_uint32_t) ((cc->counter + l) >> 32);
+			in[14][l] = cc->nonce[0];
+			in[15][l] = cc->nonce[1];
+		}
+		cc->counter += LANES;
+
+		memcpy(x, in, sizeof(x));
+		for (r = 0; r < 10; r++) {
+			quarter(x, 0, 4,  8, 12);
+			quarter(x, 1, 5,  9, 13);
+			quarter(x, 2, 6, 10, 14);
+			quarter(x, 3, 7, 11, 15);
+			quarter(x, 0, 5, 10, 15);
+			quarter(x, 1, 6, 11, 12);
+			quarter(x, 2, 7,  8, 13);
+			quarter(x, 3, 4,  9, 14);
+		}
+
+		for (l = 0; l < LANES; l++) {
+			for (i = 0; i < 16; i++) {
+				w = x[i][l] + in[i][l];
+				memcpy(out + off + l * 64 + i * 4, &w, sizeof(w));
+			}
+		}
+	}
+}
+
+static struct chacha cc;
+static tc_uint8_t rbuf[RANDSZ];
+static size_t rused = RANDSZ;
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static unsigned random_byte(void) {
+	if (rused == RANDSZ) {
+		chacha_fill(&cc, rbuf, RANDSZ);
+		rused = 0;
+	}
+	return rbuf[rused++];
+}
+
+/* returns a uniform number below n (n <= 65536) by masking and rejecting */
+static unsigned uniform(unsigned n) {
+	unsigned mask, v;
+
+	for (mask = 1; mask < n - 1; mask = (mask << 1) | 1) {
+		;
+	}
+
+	do {
+		v = random_byte();
+		if (mask > 0xFF) {
+			v = (v << 8) | random_byte();
+		}
+		v &= mask;
+	} while (v >= n);
+
+	return v;
+}
+
+static void flush(void) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < outlen; off += n) {
+		n = write(TC_STDOUT, out + off, outlen - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	outlen = 0;
+}
+
+static int class_of(int ch) {
+	if (ch >= 'A' && ch <= 'Z') {
+		return 0;
+	} else if (ch >= 'a' && ch <= 'z') {
+		return 1;
+	} else if (ch >= '0' && ch <= '9') {
+		return 2;
+	}
+	return 3;
+}
 
 int main(int argc, char *argv[]) {
 
-	unsigned seed;
 	int fd;
 	int i;
-	int j;
+	unsigned j;
+	unsigned k;
+	int flag_r;
+	char *alphabet;
+	size_t alphabet_size;
+	char classes[NCLASSES][256];
+	size_t class_size[NCLASSES];
+	int required[NCLASSES];
+	int nrequired;
+	char *pw;
+	char tmp;
 	struct tc_prog_arg *arg;
 	unsigned pwlen = 8;
 	unsigned pwcnt = 1;
 
 	static struct tc_prog_arg args[] = {
+		{ .arg = 'a', .longarg = "alphabet", .description = "characters to build passwords from (default A-Za-z0-9_-)", .has_value = 1 },
 		TC_PROG_ARG_HELP,
+		{ .arg = 'r', .longarg = "require", .description = "include at least one upper case letter, lower case letter, digit and symbol, where the alphabet has them", .has_value = 0 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "pwgen", .description = "generate passwords" },
+		{ .command = "pwgen -r 16 1000000 > secrets.txt", .description = "generate a million 16 character passwords that each use every character class" },
+		{ .command = "pwgen -a 'abcdefghjkmnpqrstuvwxyz23456789' 10", .description = "generate a password without look-alike characters" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -57,11 +206,21 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	alphabet = ALPHABET;
+	flag_r = 0;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'a':
+				alphabet = argval;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'r':
+				flag_r = 1;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -79,26 +238,68 @@ int main(int argc, char *argv[]) {
 		pwcnt = (unsigned) tc_atoi(argv[1]);
 	}
 
+	alphabet_size = tc_strlen(alphabet);
+	if (alphabet_size < 2 || alphabet_size > 256) {
+		tc_puterrln("pwgen: alphabet must have between 2 and 256 characters");
+		tc_exit(TC_EXIT_FAILURE);
+	} else if (pwlen > MAXLEN) {
+		tc_puterrln("pwgen: length must be at most 4096");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	/* split the alphabet into the classes a password must draw from */
+	tc_memset(class_size, '\0', sizeof(class_size));
+	for (j = 0; j < alphabet_size; j++) {
+		k = class_of(alphabet[j]);
+		classes[k][class_size[k]++] = alphabet[j];
+	}
+	nrequired = 0;
+	for (i = 0; flag_r && i < NCLASSES; i++) {
+		if (class_size[i] > 0) {
+			required[nrequired++] = i;
+		}
+	}
+	if ((unsigned) nrequired > pwlen) {
+		tc_puterrln("pwgen: password too short to include every character class");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
 	fd = tc_open_reader("/dev/urandom");
-	if (fd == TC_ERR) {
+	if (fd == -1 || read(fd, &cc, sizeof(cc.key) + sizeof(cc.nonce)) != sizeof(cc.key) + sizeof(cc.nonce)) {
 		tc_puterrln("Could not open /dev/urandom for reading");
 		tc_exit(TC_EXIT_FAILURE);
 	}
-	((char*) &seed)[0] = tc_getc(fd);
-	((char*) &seed)[1] = tc_getc(fd);
-	((char*) &seed)[2] = tc_getc(fd);
-	((char*) &seed)[3] = tc_getc(fd);
 	tc_close(fd);
-	tc_srand(seed);
-
+	cc.counter = 0;
 
 	for (i = 0; i < pwcnt; i++) {
-		for (j = 0; j < pwlen; j++) {
-			int n = tc_abs(tc_rand()) & (alphabet_size - 1);
-			tc_putc(TC_STDOUT, alphabet[n]);
+		if (outlen + pwlen + 1 > OUTSZ) {
+			flush();
+		}
+		pw = out + outlen;
+
+		/* one character from each required class, the rest from the
+		 * whole alphabet, then shuffled, so no password is ever retried
+		 */
+		for (j = 0; j < (unsigned) nrequired; j++) {
+			k = required[j];
+			pw[j] = classes[k][uniform(class_size[k])];
+		}
+		for (; j < pwlen; j++) {
+			pw[j] = alphabet[uniform(alphabet_size)];
 		}
-		tc_putc(TC_STDOUT, TC_NEWLINE);
+		for (j = nrequired > 0 ? pwlen : 0; j > 1; j--) {
+			k = uniform(j);
+			tmp = pw[j - 1];
+			pw[j - 1] = pw[k];
+			pw[k] = tmp;
+		}
+
+		pw[pwlen] = '\n';
+		outlen += pwlen + 1;
 	}
 
+	flush();
+
 	tc_exit(TC_EXIT_SUCCESS);
 }
@@ -18,10 +18,18 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -79,72 +87,251 @@ static struct pass passes[35] = {
 };
 
 #define NPASSES (sizeof(passes)/sizeof(passes[0]))
+#define ALIGN 4096
+#define BLOCKSZ (3 * 256 * 1024) /* a whole number of patterns and pages */
+#define LANES 8
+#define MAXTHREADS 64
 
-static void scrub(char *filename) {
-	int ch, fd, rc, i, pati;
-	FILE *fp;
-	struct stat st;
-	off_t pos;
+/* ChaCha20 keystream generator, LANES blocks are computed side by side so
+ * the round function vectorizes.
+ */
+struct chacha {
+	tc_uint32_t key[8];
+	tc_uint32_t nonce[2];
+	tc_uint64_t counter;
+};
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void quarter(tc_uint32_t x[16][LANES], int a, int b, int c, int d) {
+	int l;
+
+	for (l = 0; l < LANES; l++) {
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL(x[d][l], 16);
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL(x[b][l], 12);
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL(x[d][l], 8);
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL(x[b][l], 7);
+	}
+}
+
+/* len must be a multiple of 64 * LANES */
+static void chacha_fill(struct chacha *cc, tc_uint8_t *out, size_t len) {
+	static const tc_uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+	tc_uint32_t in[16][LANES], x[16][LANES], w;
+	size_t off;
+	int i, l, r;
+
+	for (off = 0; off < len; off += 64 * LANES) {
+		for (l = 0; l < LANES; l++) {
+			for (i = 0; i < 4; i++) {
+				in[i][l] = sigma[i];
+			}
+			for (i = 0; i < 8; i++) {
+				in[4+i][l] = cc->key[i];
+			}
+			in[12][l] = (tc_uint32_t) (cc->counter + l);
+			in[13][l] = (tc_uint32_t) ((cc->counter + l) >> 32);
+			in[14][l] = cc->nonce[0];
+			in[15][l] = cc->nonce[1];
+		}
+		cc->counter += LANES;
+
+		memcpy(x, in, sizeof(x));
+		for (r = 0; r < 10; r++) {
+			quarter(x, 0, 4,  8, 12);
+			quarter(x, 1, 5,  9, 13);
+			quarter(x, 2, 6, 10, 14);
+			quarter(x, 3, 7, 11, 15);
+			quarter(x, 0, 5, 10, 15);
+			quarter(x, 1, 6, 11, 12);
+			quarter(x, 2, 7,  8, 13);
+			quarter(x, 3, 4,  9, 14);
+		}
+
+		for (l = 0; l < LANES; l++) {
+			for (i = 0; i < 16; i++) {
+				w = x[i][l] + in[i][l];
+				memcpy(out + off + l * 64 + i * 4, &w, sizeof(w));
+			}
+		}
+	}
+}
+
+static tc_uint8_t *patterns[NPASSES]; /* pattern repeated over BLOCKSZ bytes */
+static tc_uint32_t key[8];
+static int flag_d = 0;
+static char **files;
+static int nfiles;
+static int next_file = 0;
 
-	fp = fopen(filename, "r+");
-	if (fp == TC_NULL) {
-		perror("fopen");
+static void *xmalloc_aligned(size_t n) {
+	void *p;
+
+	if (posix_memalign(&p, ALIGN, n) != 0) {
+		tc_puterrln("Out of Memory");
 		tc_exit(TC_EXIT_FAILURE);
 	}
+	return p;
+}
+
+/* pattern buffers are built once and shared by every file and thread */
+static void prepare(void) {
+	size_t i, j, k;
+
+	for (i = 0; i < NPASSES; i++) {
+		if (passes[i].method != PATTERN) {
+			continue;
+		}
+		for (j = 0; j < i; j++) {
+			if (passes[j].method == PATTERN && memcmp(passes[i].pattern, passes[j].pattern, 3) == 0) {
+				patterns[i] = patterns[j];
+				break;
+			}
+		}
+		if (patterns[i] == TC_NULL) {
+			patterns[i] = (tc_uint8_t *) xmalloc_aligned(BLOCKSZ);
+			for (k = 0; k < BLOCKSZ; k++) {
+				patterns[i][k] = passes[i].pattern[k % 3];
+			}
+		}
+	}
+}
+
+static int write_at(int fd, const tc_uint8_t *buf, size_t len, off_t pos) {
+	ssize_t nwritten;
+#ifdef O_DIRECT
+	int buffered = 0;
+#endif
+
+	while (len > 0) {
+		nwritten = pwrite(fd, buf, len, pos);
+		if (nwritten == -1 && errno == EINTR) {
+			continue;
+#ifdef O_DIRECT
+		} else if (nwritten == -1 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+			/* the unaligned tail of the file can't be written unbuffered */
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			buffered = 1;
+			continue;
+#endif
+		} else if (nwritten <= 0) {
+			return TC_ERR;
+		}
+		buf += nwritten;
+		len -= nwritten;
+		pos += nwritten;
+	}
+
+#ifdef O_DIRECT
+	/* back to unbuffered for the next pass */
+	if (buffered) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+	}
+#endif
+
+	return TC_OK;
+}
+
+static int scrub(char *filename, tc_uint32_t id, tc_uint8_t *rbuf) {
+	int fd, flags;
+	size_t i, len;
+	struct stat st;
+	struct chacha cc;
+	const tc_uint8_t *buf;
+	off_t pos;
 
-	fd = fileno(fp);
+	flags = O_WRONLY;
+#ifdef O_DIRECT
+	if (flag_d) {
+		flags |= O_DIRECT;
+	}
+#endif
+	fd = open(filename, flags);
 	if (fd == -1) {
-		perror("fileno");
-		fclose(fp);
-		tc_exit(TC_EXIT_FAILURE);
+		perror(filename);
+		return TC_ERR;
 	}
 
-	rc = fstat(fd, &st);
-	if (rc == -1) {
-		perror("fstat");
-		fclose(fp);
-		tc_exit(TC_EXIT_FAILURE);
+	if (fstat(fd, &st) == -1) {
+		perror(filename);
+		close(fd);
+		return TC_ERR;
 	}
 
+	memcpy(cc.key, key, sizeof(key));
+	cc.nonce[0] = id;
+	cc.nonce[1] = 0;
+	cc.counter = 0;
+
 	for (i = 0; i < NPASSES; i++) {
-		rewind(fp);
-		pati = 0;
-		for (pos = 0; pos < st.st_size; pos++) {
+		for (pos = 0; pos < st.st_size; pos += len) {
+			len = st.st_size - pos < BLOCKSZ ? st.st_size - pos : BLOCKSZ;
 			switch (passes[i].method) {
 				case PATTERN:
-					fputc(passes[i].pattern[pati], fp);
-					pati = (pati + 1) % 3;
+					buf = patterns[i];
 					break;
 
 				case RANDOM:
 				default:
-					fputc(tc_rand(), fp);
+					chacha_fill(&cc, rbuf, BLOCKSZ);
+					buf = rbuf;
 					break;
 			}
+			if (write_at(fd, buf, len, pos) != TC_OK) {
+				perror(filename);
+				close(fd);
+				return TC_ERR;
+			}
 		}
 
 		/* force a write to disk */
-		fflush(fp);
-		fsync(fd);
-		sync();
+		if (fdatasync(fd) == -1) {
+			perror(filename);
+			close(fd);
+			return TC_ERR;
+		}
+	}
+
+	close(fd);
+	return TC_OK;
+}
+
+static void *worker(void *arg) {
+	tc_uint8_t *rbuf;
+	int i;
+	long rc;
+
+	rc = TC_OK;
+	rbuf = (tc_uint8_t *) xmalloc_aligned(BLOCKSZ);
+	while ((i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED)) < nfiles) {
+		if (scrub(files[i], (tc_uint32_t) i, rbuf) != TC_OK) {
+			rc = TC_ERR;
+		}
 	}
+	free(rbuf);
 
-	fclose(fp);
+	return (void *) rc;
 }
 
 int main(int argc, char *argv[]) {
 
-	int i;
+	int fd, rc;
+	long i, nthreads, nstarted;
+	pthread_t threads[MAXTHREADS];
+	void *result;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'd', .longarg = "direct", .description = "bypass the page cache with O_DIRECT", .has_value = 0 },
+		{ .arg = 'j', .longarg = "jobs", .description = "number of files to scrub at once", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "scrub foo.txt", .description = "overwrite foo.txt" },
+		{ .command = "scrub -j 4 -d *.img", .description = "overwrite 4 image files at a time, bypassing the page cache" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -161,11 +348,21 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	nthreads = 1;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'd':
+				flag_d = 1;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'j':
+				nthreads = tc_atoi(argval);
+				nthreads = nthreads < 1 ? 1 : nthreads > MAXTHREADS ? MAXTHREADS : nthreads;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -181,10 +378,32 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	tc_srand((unsigned int) tc_getpid());
-	for (i = 0; i < argc; i++) {
-		scrub(argv[i]);
+	fd = tc_open_reader("/dev/urandom");
+	if (fd == -1 || read(fd, key, sizeof(key)) != sizeof(key)) {
+		tc_puterrln("Could not open /dev/urandom for reading");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	tc_close(fd);
+
+	prepare();
+
+	files = argv;
+	nfiles = argc;
+	nstarted = 0;
+	for (i = 1; i < nthreads && i < nfiles; i++) {
+		if (pthread_create(&threads[nstarted], TC_NULL, worker, TC_NULL) != 0) {
+			break;
+		}
+		nstarted++;
+	}
+
+	rc = worker(TC_NULL) == (void *) TC_OK ? TC_EXIT_SUCCESS : TC_EXIT_FAILURE;
+	for (i = 0; i < nstarted; i++) {
+		pthread_join(threads[i], &result);
+		if (result != (void *) TC_OK) {
+			rc = TC_EXIT_FAILURE;
+		}
 	}
 
-	tc_exit(TC_EXIT_SUCCESS);
+	tc_exit(rc);
 }
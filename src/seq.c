@@ -20,67 +20,590 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#define SLICE (64 * 1024) /* numbers rendered per block */
+#define MAXJOBS 64
+#define MAXDECIMALS 18
+#define MAXPRECISION 64
+#define MAXWIDTH 256
+
+/* a -f format split around its one conversion */
+struct format {
+	char *prefix;
+	size_t prefixlen;
+	char *suffix;
+	size_t suffixlen;
+	char spec[32];  /* the conversion alone, for snprintf */
+	int fast;       /* plain %f that can be rendered without snprintf */
+	int left;
+	int zero;
+	int width;
+	int precision;
+};
+
+/* numbers are fixed point: first, step and values are scaled by 10^decimals */
+struct seq {
+	tc_int64_t first;
+	tc_int64_t step;
+	tc_uint64_t count; /* numbers to print minus one, so the full 64-bit range fits */
+	int decimals;
+	tc_uint64_t unit;  /* 10^decimals */
+	int width;         /* zero pad to this many characters with -w */
+	struct format *fmt;
+	const char *sep;
+	size_t seplen;
+	size_t maxlen;     /* longest rendering of one number plus separator */
+};
+
+struct slice {
+	struct seq *seq;
+	tc_uint64_t k;
+	tc_uint64_t n;
+	char *buf;
+	size_t len;
+};
+
+static const char pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static void usage(FILE *f) {
+	fprintf(f, "usage: seq [OPTIONS] LAST\n");
+	fprintf(f, "usage: seq [OPTIONS] FIRST LAST\n");
+	fprintf(f, "usage: seq [OPTIONS] FIRST STEP LAST\n");
+}
+
+/* writes the decimal digits of v ending just before end, returns the first digit */
+static char *digits(char *end, tc_uint64_t v) {
+	while (v >= 100) {
+		end -= 2;
+		memcpy(end, pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		end -= 2;
+		memcpy(end, pairs + v * 2, 2);
+	} else {
+		*--end = '0' + v;
+	}
+	return end;
+}
+
+/* renders mag / unit with decimals digits after the point at p, zero
+ * padded to width after any sign, returns the end
+ */
+static char *render_fixed(char *p, int neg, tc_uint64_t mag, int decimals, tc_uint64_t unit, int width) {
+	char tmp[48];
+	char *start, *point, *end;
+	tc_uint64_t frac;
+	int i, len;
+
+	end = point = tmp + sizeof(tmp);
+	if (decimals > 0) {
+		frac = mag % unit;
+		mag /= unit;
+		for (i = 0; i < decimals; i++) {
+			*--point = '0' + frac % 10;
+			frac /= 10;
+		}
+		*--point = '.';
+	}
+	start = digits(point, mag);
+	len = (end - start) + neg;
+
+	if (neg) {
+		*p++ = '-';
+	}
+	for (; len < width; len++) {
+		*p++ = '0';
+	}
+	memcpy(p, start, end - start);
+	return p + (end - start);
+}
+
+static char *render(char *p, tc_int64_t v, struct seq *s, int width) {
+	return render_fixed(p, v < 0, v < 0 ? -(tc_uint64_t) v : (tc_uint64_t) v, s->decimals, s->unit, width);
+}
+
+/* renders v through the -f format */
+static char *render_format(char *p, tc_int64_t v, struct seq *s) {
+	struct format *f = s->fmt;
+	char tmp[48 + MAXPRECISION];
+	char *end, *digit;
+	tc_uint64_t mag, div, unit, rem;
+	int i, len, pad;
+
+	memcpy(p, f->prefix, f->prefixlen);
+	p += f->prefixlen;
+
+	end = render(tmp, v, s, 0);
+	if (f->fast) {
+		if (f->precision < s->decimals) {
+			/* round the exact value half to even, as printf does */
+			mag = v < 0 ? -(tc_uint64_t) v : (tc_uint64_t) v;
+			for (div = 1, i = f->precision; i < s->decimals; i++) {
+				div *= 10;
+			}
+			unit = s->unit / div;
+			rem = mag % div;
+			mag /= div;
+			if (rem > div - rem || (rem == div - rem && (mag & 1))) {
+				mag++;
+			}
+			end = render_fixed(tmp, v < 0, mag, f->precision, unit, 0);
+		} else if (f->precision > s->decimals) {
+			if (s->decimals == 0) {
+				*end++ = '.';
+			}
+			for (i = s->decimals; i < f->precision; i++) {
+				*end++ = '0';
+			}
+		}
+		len = end - tmp;
+		pad = f->width > len ? f->width - len : 0;
+		digit = tmp;
+		if (!f->left && f->zero && *digit == '-') {
+			*p++ = *digit++;
+		}
+		if (!f->left) {
+			memset(p, f->zero ? '0' : ' ', pad);
+			p += pad;
+		}
+		memcpy(p, digit, end - digit);
+		p += end - digit;
+		if (f->left) {
+			memset(p, ' ', pad);
+			p += pad;
+		}
+	} else {
+		/* the exact decimal value, rounded once to the nearest double */
+		*end = '\0';
+		p += snprintf(p, s->maxlen, f->spec, strtod(tmp, TC_NULL));
+	}
+
+	memcpy(p, f->suffix, f->suffixlen);
+	return p + f->suffixlen;
+}
+
+static tc_int64_t nth(struct seq *s, tc_uint64_t k) {
+	/* unsigned arithmetic wraps instead of overflowing */
+	return (tc_int64_t) ((tc_uint64_t) s->first + k * (tc_uint64_t) s->step);
+}
+
+/* renders numbers k through k + n - 1, each preceded by the separator except the first of the sequence */
+static void render_slice(struct slice *sl) {
+	struct seq *s = sl->seq;
+	char num[32];
+	char *p, *digit, *end;
+	tc_uint64_t i;
+	int len;
+
+	p = sl->buf;
+
+	if (s->step == 1 && s->decimals == 0 && s->fmt == TC_NULL && nth(s, sl->k) >= 0) {
+		/* counting up by one, so bump the ASCII digits in place instead of dividing */
+		end = num + sizeof(num);
+		digit = render(num + 1, nth(s, sl->k), s, s->width);
+		len = digit - (num + 1);
+		memmove(end - len, num + 1, len);
+		for (i = 0; i < sl->n; i++) {
+			if (sl->k + i != 0) {
+				memcpy(p, s->sep, s->seplen);
+				p += s->seplen;
+			}
+			memcpy(p, end - len, len);
+			p += len;
+
+			for (digit = end - 1; digit >= end - len && *digit == '9'; digit--) {
+				*digit = '0';
+			}
+			if (digit >= end - len) {
+				(*digit)++;
+			} else {
+				*digit = '1';
+				len++;
+			}
+		}
+	} else {
+		for (i = 0; i < sl->n; i++) {
+			if (sl->k + i != 0) {
+				memcpy(p, s->sep, s->seplen);
+				p += s->seplen;
+			}
+			if (s->fmt != TC_NULL) {
+				p = render_format(p, nth(s, sl->k + i), s);
+			} else {
+				p = render(p, nth(s, sl->k + i), s, s->width);
+			}
+		}
+	}
+
+	sl->len = p - sl->buf;
+}
+
+/* parses a decimal number such as -12, 0.25 or 1e3 into a mantissa scaled by 10^decimals */
+static int parse(const char *str, tc_int64_t *value, int *decimals) {
+	const char *p;
+	tc_uint64_t mag, limit;
+	int neg, exp, expneg, ndigits, frac;
+
+	p = str;
+	neg = *p == '-';
+	if (*p == '-' || *p == '+') {
+		p++;
+	}
+
+	limit = (tc_uint64_t) LLONG_MAX + neg;
+	mag = 0;
+	ndigits = frac = 0;
+	for (; tc_isdigit(*p) || (*p == '.' && !frac); p++) {
+		if (*p == '.') {
+			frac = 1;
+			*decimals = 0;
+			continue;
+		}
+		if (mag > (limit - (*p - '0')) / 10) {
+			return TC_ERR;
+		}
+		mag = mag * 10 + (*p - '0');
+		*decimals += frac;
+		ndigits++;
+	}
+	if (!frac) {
+		*decimals = 0;
+	}
+	if (ndigits == 0) {
+		return TC_ERR;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		expneg = *p == '-';
+		if (*p == '-' || *p == '+') {
+			p++;
+		}
+		if (!tc_isdigit(*p)) {
+			return TC_ERR;
+		}
+		for (exp = 0; tc_isdigit(*p) && exp < 100; p++) {
+			exp = exp * 10 + (*p - '0');
+		}
+		*decimals += expneg ? exp : -exp;
+		for (; *decimals < 0; (*decimals)++) {
+			if (mag > limit / 10) {
+				return TC_ERR;
+			}
+			mag *= 10;
+		}
+	}
+
+	if (*p != '\0' || *decimals > MAXDECIMALS) {
+		return TC_ERR;
+	}
+
+	*value = (tc_int64_t) (neg ? -mag : mag);
+	return TC_OK;
+}
+
+/* rescales v from 10^from to 10^to, to >= from */
+static int rescale(tc_int64_t *v, int from, int to) {
+	for (; from < to; from++) {
+		if (*v > LLONG_MAX / 10 || *v < LLONG_MIN / 10) {
+			return TC_ERR;
+		}
+		*v *= 10;
+	}
+	return TC_OK;
+}
+
+/* splits the -f format into literal text and its one floating point conversion */
+static int compile_format(char *str, struct format *f) {
+	char *p, *q, *spec;
+	int nconv;
+
+	tc_memset(f, '\0', sizeof(struct format));
+	f->prefix = (char *) tc_malloc(tc_strlen(str) + 1);
+	f->suffix = (char *) tc_malloc(tc_strlen(str) + 1);
+	if (f->prefix == TC_NULL || f->suffix == TC_NULL) {
+		return TC_ERR;
+	}
+
+	q = f->prefix;
+	nconv = 0;
+	for (p = str; *p != '\0'; p++) {
+		if (*p != '%') {
+			*q++ = *p;
+			continue;
+		} else if (p[1] == '%') {
+			*q++ = '%';
+			p++;
+			continue;
+		} else if (nconv++ > 0) {
+			return TC_ERR;
+		}
+
+		spec = p++;
+		f->fast = 1;
+		for (; *p != '\0' && strchr("-+ #0", *p) != TC_NULL; p++) {
+			f->left |= *p == '-';
+			f->zero |= *p == '0';
+			f->fast &= *p == '-' || *p == '0';
+		}
+		for (f->width = 0; tc_isdigit(*p); p++) {
+			f->width = f->width * 10 + (*p - '0');
+			if (f->width > MAXWIDTH) {
+				return TC_ERR;
+			}
+		}
+		f->precision = 6;
+		if (*p == '.') {
+			for (p++, f->precision = 0; tc_isdigit(*p); p++) {
+				f->precision = f->precision * 10 + (*p - '0');
+				if (f->precision > MAXPRECISION) {
+					return TC_ERR;
+				}
+			}
+		}
+		if (*p == '\0' || strchr("eEfFgGaA", *p) == TC_NULL || (size_t) (p - spec + 1) >= sizeof(f->spec)) {
+			return TC_ERR;
+		}
+		f->fast &= *p == 'f' || *p == 'F';
+		memcpy(f->spec, spec, p - spec + 1);
+
+		f->prefixlen = q - f->prefix;
+		q = f->suffix;
+	}
+
+	if (nconv == 0) {
+		return TC_ERR;
+	}
+	f->suffixlen = q - f->suffix;
+
+	return TC_OK;
+}
+
+static void *worker(void *arg) {
+	render_slice((struct slice *) arg);
+	return TC_NULL;
+}
+
+static void output(char *buf, size_t len) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < len; off += n) {
+		n = write(TC_STDOUT, buf + off, len - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+}
+
+/* renders blocks of the sequence on njobs threads and writes them in order */
+static void generate(struct seq *s, int njobs) {
+	struct slice slices[MAXJOBS];
+	pthread_t threads[MAXJOBS];
+	int created[MAXJOBS];
+	tc_uint64_t k, remaining;
+	int i, n, last;
+
+	for (i = 0; i < njobs; i++) {
+		slices[i].seq = s;
+		slices[i].buf = (char *) tc_malloc(SLICE * s->maxlen);
+		if (slices[i].buf == TC_NULL) {
+			perror("malloc");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+
+	k = 0;
+	remaining = s->count; /* numbers left minus one */
+	last = 0;
+	while (!last) {
+		for (n = 0; n < njobs && !last; n++) {
+			slices[n].k = k;
+			if (remaining < SLICE) {
+				slices[n].n = remaining + 1;
+				last = 1;
+			} else {
+				slices[n].n = SLICE;
+				remaining -= SLICE;
+			}
+			k += slices[n].n;
+		}
+
+		for (i = 1; i < n; i++) {
+			created[i] = pthread_create(&threads[i], TC_NULL, worker, &slices[i]) == 0;
+			if (!created[i]) {
+				render_slice(&slices[i]);
+			}
+		}
+		render_slice(&slices[0]);
+
+		for (i = 0; i < n; i++) {
+			if (i > 0 && created[i]) {
+				pthread_join(threads[i], TC_NULL);
+			}
+			output(slices[i].buf, slices[i].len);
+		}
+	}
+
+	output("\n", 1);
+
+	for (i = 0; i < njobs; i++) {
+		slices[i].buf = tc_free(slices[i].buf);
+	}
+}
+
 int main(int argc, char *argv[]) {
 
-	int ch;
-	long long first = 1;
- 	long long step = 1;
-	long long last = 1;
-	long long i;
+	int i;
+	int flag_w;
+	int njobs;
+	int decimals;
+	char *flag_f;
+	char *flag_s;
+	char tmp[48];
+	tc_int64_t args[3];
+	int scales[3];
+	tc_int64_t first = 1;
+	tc_int64_t step = 1;
+	tc_int64_t last = 1;
+	int first_decimals = 0, step_decimals = 0, last_decimals = 0;
+	struct format fmt;
+	struct seq s;
+
+	/* defaults */
+	flag_w = 0;
+	flag_f = TC_NULL;
+	flag_s = "\n";
+	njobs = sysconf(_SC_NPROCESSORS_ONLN);
 
 	/* using getopt is kinda messy when negative numbers are allowed
 	 * e.g. seq -10 2 10
 	 * use manual argument processing
 	 */
-	if (argc == 1 || argc > 4) {
-		fprintf(stderr, "usage: seq [OPTIONS] LAST\n");
-		fprintf(stderr, "usage: seq [OPTIONS] FIRST LAST\n");
-		fprintf(stderr, "usage: seq [OPTIONS] FIRST STEP LAST\n");
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--equal-width") == 0) {
+			flag_w = 1;
+		} else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0) && i + 1 < argc) {
+			flag_f = argv[++i];
+		} else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--separator") == 0) && i + 1 < argc) {
+			flag_s = argv[++i];
+		} else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+			njobs = tc_atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
+			fprintf(stdout, "seq (%s) v%s\n", TC_VERSION_NAME, TC_VERSION_STRING);
+			fprintf(stdout, "Copyright (C) 2022, 2023, 2024  Thomas Cort\n");
+			fprintf(stdout, "License GPLv3+: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>.\n");
+			fprintf(stdout, "This is free software: you are free to change and redistribute it.\n");
+			fprintf(stdout, "There is NO WARRANTY, to the extent permitted by law.\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "Written by Thomas Cort.\n");
+			tc_exit(TC_EXIT_SUCCESS);
+		} else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			fprintf(stdout, "seq -- write a sequence of numbers to standard output\n");
+			fprintf(stdout, "\n");
+			usage(stdout);
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  -f, --format FORMAT  print numbers with a printf style floating point FORMAT\n");
+			fprintf(stdout, "  -h, --help           print help text\n");
+			fprintf(stdout, "  -j, --jobs N         number of threads to render numbers with\n");
+			fprintf(stdout, "  -s, --separator SEP  print SEP between numbers instead of a newline\n");
+			fprintf(stdout, "  -V, --version        print version and copyright info\n");
+			fprintf(stdout, "  -w, --equal-width    pad numbers with leading zeros to equal width\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "examples:\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  # print the numbers 1 to 10\n");
+			fprintf(stdout, "  seq 10\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  # print the numbers 5 to 55\n");
+			fprintf(stdout, "  seq 5 55\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  # print the numbers 100 to 1000 by 100s\n");
+			fprintf(stdout, "  seq 100 100 1000\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  # print 001 to 100 on one line\n");
+			fprintf(stdout, "  seq -w -s ' ' 100\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  # print 0 to 1 in tenths\n");
+			fprintf(stdout, "  seq 0 0.1 1\n");
+			fprintf(stdout, "\n");
+			fprintf(stdout, "  # print percentages with two decimal places\n");
+			fprintf(stdout, "  seq -f '%%.2f%%%%' 0 12.5 100\n");
+			tc_exit(TC_EXIT_SUCCESS);
+		} else {
+			break;
+		}
+	}
+
+	argc -= i;
+	argv += i;
+
+	if (argc < 1 || argc > 3) {
+		usage(stderr);
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	if (flag_w && flag_f != TC_NULL) {
+		fprintf(stderr, "seq: -w and -f cannot be used together\n");
 		tc_exit(TC_EXIT_FAILURE);
-	} else if (argc == 2 && strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0) {
-		fprintf(stdout, "seq (%s) v%s\n", TC_VERSION_NAME, TC_VERSION_STRING);
-		fprintf(stdout, "Copyright (C) 2022, 2023, 2024  Thomas Cort\n");
-		fprintf(stdout, "License GPLv3+: GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>.\n");
-		fprintf(stdout, "This is free software: you are free to change and redistribute it.\n");
-		fprintf(stdout, "There is NO WARRANTY, to the extent permitted by law.\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "Written by Thomas Cort.\n");
-		tc_exit(TC_EXIT_SUCCESS);
-	} else if (argc == 2 && strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
-		fprintf(stdout, "seq -- write a sequence of numbers to standard output\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "usage: seq [OPTIONS] LAST\n");
-		fprintf(stdout, "usage: seq [OPTIONS] FIRST LAST\n");
-		fprintf(stdout, "usage: seq [OPTIONS] FIRST STEP LAST\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "  -h, --help     print help text\n");
-		fprintf(stdout, "  -V, --version  print version and copyright info\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "examples:\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "  # print the numbers 1 to 10\n");
-		fprintf(stdout, "  seq 10\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "  # print the numbers 5 to 55\n");
-		fprintf(stdout, "  seq 5 55\n");
-		fprintf(stdout, "\n");
-		fprintf(stdout, "  # print the numbers 100 to 1000 by 100s\n");
-		fprintf(stdout, "  seq 100 100 1000\n");
-		tc_exit(TC_EXIT_SUCCESS);
-	} else if (argc == 2)  {
-		last = strtoll(argv[1], TC_NULL, 10);
+	} else if (flag_f != TC_NULL && compile_format(flag_f, &fmt) != TC_OK) {
+		fprintf(stderr, "seq: invalid format '%s'\n", flag_f);
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (parse(argv[i], &args[i], &scales[i]) != TC_OK) {
+			fprintf(stderr, "seq: invalid number '%s'\n", argv[i]);
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+
+	if (argc == 1)  {
+		last = args[0];
+		last_decimals = scales[0];
+	} else if (argc == 2) {
+		first = args[0];
+		first_decimals = scales[0];
+		last = args[1];
+		last_decimals = scales[1];
 	} else if (argc == 3) {
-		first = strtoll(argv[1], TC_NULL, 10);
-		last = strtoll(argv[2], TC_NULL, 10);
-	} else if (argc == 4) {
-		first = strtoll(argv[1], TC_NULL, 10);
-		step = strtoll(argv[2], TC_NULL, 10);
-		last = strtoll(argv[3], TC_NULL, 10);
+		first = args[0];
+		first_decimals = scales[0];
+		step = args[1];
+		step_decimals = scales[1];
+		last = args[2];
+		last_decimals = scales[2];
+	}
+
+	/* numbers are printed with as many decimals as first or step has, last
+	 * only bounds the sequence so it's compared at its own precision
+	 */
+	decimals = first_decimals > step_decimals ? first_decimals : step_decimals;
+	i = decimals > last_decimals ? decimals : last_decimals;
+	if (rescale(&first, first_decimals, i) != TC_OK || rescale(&step, step_decimals, i) != TC_OK || rescale(&last, last_decimals, i) != TC_OK) {
+		fprintf(stderr, "seq: number out of range\n");
+		tc_exit(TC_EXIT_FAILURE);
 	}
 
 	/* validate inputs */
@@ -95,9 +618,46 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	for (i = first; i <= last; i += step) {
-		fprintf(stdout, "%lld\n", i);
+	if (step > 0) {
+		s.count = ((tc_uint64_t) last - (tc_uint64_t) first) / (tc_uint64_t) step;
+	} else {
+		s.count = ((tc_uint64_t) first - (tc_uint64_t) last) / -(tc_uint64_t) step;
+	}
+
+	/* drop the extra precision of last, first and step have only zeros there */
+	for (; i > decimals; i--) {
+		first /= 10;
+		step /= 10;
+	}
+
+	s.first = first;
+	s.step = step;
+	s.decimals = decimals;
+	for (s.unit = 1, i = 0; i < decimals; i++) {
+		s.unit *= 10;
 	}
+	s.fmt = flag_f != TC_NULL ? &fmt : TC_NULL;
+
+	s.width = 0;
+	if (flag_w) {
+		s.width = render(tmp, first, &s, 0) - tmp;
+		i = render(tmp, nth(&s, s.count), &s, 0) - tmp;
+		s.width = i > s.width ? i : s.width;
+	}
+	s.sep = flag_s;
+	s.seplen = tc_strlen(flag_s);
+	s.maxlen = (s.width > 21 ? s.width : 21) + decimals + 1 + s.seplen;
+	if (s.fmt != TC_NULL) {
+		/* %f of a 19 digit number can't exceed 21 + precision characters, %e and %g are shorter */
+		s.maxlen = fmt.prefixlen + fmt.suffixlen + (fmt.width > 24 + fmt.precision ? fmt.width : 24 + fmt.precision) + s.seplen;
+	}
+
+	njobs = njobs < 1 ? 1 : njobs > MAXJOBS ? MAXJOBS : njobs;
+	if (s.count / SLICE < (tc_uint64_t) njobs) {
+		njobs = s.count / SLICE + 1;
+	}
+
+	generate(&s, njobs);
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
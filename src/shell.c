@@ -21,7 +21,9 @@
 #include <tc/tc.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,10 +32,44 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#define MAXCMDS 64
+#define HASHSZ 64
+
+extern char **environ;
+
 static int done = 0;
+static int status = 0;
+static int use_fork = 0;
+
+/* prompt text, rebuilt only after cd changes the directory */
+static char prompt_text[MAXPATHLEN + MAXHOSTNAMELEN + 64];
+static int prompt_valid = 0;
+
+struct command {
+	char **argv;
+	int argc;
+	char *in;
+	char *out;
+	int append;
+};
+
+struct pipeline {
+	struct command cmds[MAXCMDS];
+	int ncmds;
+	char **words;
+};
+
+/* locations of commands found in PATH, like the hash builtin of sh */
+struct hashent {
+	char *name;
+	char *path;
+	unsigned hits;
+	struct hashent *next;
+};
+
+static struct hashent *table[HASHSZ];
 
 static void prompt(void) {
-	int fd;
 	int rc;
 	uid_t uid;
 	struct passwd *passwd;
@@ -41,8 +77,9 @@ static void prompt(void) {
 	char *p;
 	char hostname[MAXHOSTNAMELEN+1];
 
-	rc = tc_isatty(TC_STDOUT);
-	if (rc != 1) {
+	if (prompt_valid) {
+		fputs(prompt_text, stdout);
+		fflush(stdout);
 		return;
 	}
 
@@ -70,66 +107,410 @@ static void prompt(void) {
 		return;
 	}
 
-	fprintf(stdout, "%s@%s:%s%c ", passwd->pw_name, hostname, p, geteuid() == 0 ? '#' : '$');
+	snprintf(prompt_text, sizeof(prompt_text), "%s@%s:%s%c ", passwd->pw_name, hostname, p, geteuid() == 0 ? '#' : '$');
+	prompt_valid = 1;
+
+	fputs(prompt_text, stdout);
 	fflush(stdout);
 }
 
-static char **argvify(char *cmdline) {
+static unsigned hash(const char *s) {
+	unsigned h = 5381;
 
-	int i, j;
-	int n, len;
-	char **argv;
+	while (*s != '\0') {
+		h = h * 33 + (unsigned char) *s++;
+	}
+
+	return h % HASHSZ;
+}
+
+static void hash_clear(void) {
+	int i;
+	struct hashent *e, *next;
 
-	len = tc_strlen(cmdline);
-	for (i = 0, n = 0; i < len; i++) {
-		if (cmdline[i] == ' ') {
-			n++;
-		} else if (cmdline[i] == '\n' || cmdline[i] == '\r') {
-			cmdline[i] = '\0';
+	for (i = 0; i < HASHSZ; i++) {
+		for (e = table[i]; e != TC_NULL; e = next) {
+			next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
 		}
+		table[i] = TC_NULL;
+	}
+}
+
+/* returns the full path of name, searching PATH only on a cache miss */
+static char *lookup(char *name) {
+	unsigned h;
+	size_t len;
+	char *path, *dir, *end, *candidate;
+	struct hashent *e;
+
+	if (strchr(name, '/') != TC_NULL) {
+		return name;
+	}
+
+	h = hash(name);
+	for (e = table[h]; e != TC_NULL; e = e->next) {
+		if (!strcmp(e->name, name)) {
+			e->hits++;
+			return e->path;
+		}
+	}
+
+	path = getenv("PATH");
+	if (path == TC_NULL) {
+		path = "/bin:/usr/bin";
 	}
 
-	n++; /* last entry in argv must be TC_NULL */
+	len = tc_strlen(name);
+	for (dir = path; ; dir = end + 1) {
+		end = strchr(dir, ':');
+		if (end == TC_NULL) {
+			end = dir + tc_strlen(dir);
+		}
 
-	argv = (char **) malloc(sizeof(char*) * n);
-	if (argv == TC_NULL) {
+		candidate = (char *) malloc((end - dir) + len + 3);
+		if (candidate == TC_NULL) {
+			return TC_NULL;
+		}
+		if (end == dir) {
+			/* empty entry means the current directory */
+			sprintf(candidate, "./%s", name);
+		} else {
+			sprintf(candidate, "%.*s/%s", (int) (end - dir), dir, name);
+		}
+
+		if (access(candidate, X_OK) == 0) {
+			e = (struct hashent *) malloc(sizeof(struct hashent));
+			if (e == TC_NULL) {
+				free(candidate);
+				return TC_NULL;
+			}
+			e->name = tc_strdup(name);
+			e->path = candidate;
+			e->hits = 1;
+			e->next = table[h];
+			table[h] = e;
+			return candidate;
+		}
+		free(candidate);
+
+		if (*end == '\0') {
+			break;
+		}
+	}
+
+	return TC_NULL;
+}
+
+/* splits a line into words and the operators |, < and > / >> */
+static char **wordify(char *cmdline) {
+
+	int n;
+	char *p;
+	char **words;
+
+	/* a line can't hold more than one word per character */
+	words = (char **) malloc(sizeof(char*) * (tc_strlen(cmdline) + 1));
+	if (words == TC_NULL) {
 		return TC_NULL;
 	}
-	memset(argv, '\0', sizeof(char*) * n);
 
-	argv[0] = cmdline;
-	for (i = 0, j = 1; i < len; i++) {
-		if (cmdline[i] == ' ') {
-			cmdline[i] = '\0';
-			argv[j] = cmdline + i + 1;
-			j++;
+	for (p = cmdline, n = 0; *p != '\0'; ) {
+		if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+			*p++ = '\0';
+		} else if (*p == '|' || *p == '<' || *p == '>') {
+			/* operators are stored as static strings so they can't be confused with words */
+			if (*p == '|') {
+				words[n++] = "|";
+			} else if (*p == '<') {
+				words[n++] = "<";
+			} else if (p[1] == '>') {
+				words[n++] = ">>";
+				*p++ = '\0';
+			} else {
+				words[n++] = ">";
+			}
+			*p++ = '\0';
+		} else if (*p == '#') {
+			/* comment to the end of the line, e.g. #! in a script */
+			break;
+		} else {
+			words[n++] = p;
+			while (*p != '\0' && strchr(" \t\n\r|<>", *p) == TC_NULL) {
+				p++;
+			}
 		}
 	}
+	words[n] = TC_NULL;
+
+	return words;
+}
 
-	return argv;
+static int isop(const char *word, const char *op) {
+	return word != TC_NULL && !strcmp(word, op);
 }
 
-static int tryinternal(char *argv[]) {
+/* returns 0 on success, -1 on a syntax error */
+static int parse(char *cmdline, struct pipeline *pl) {
+
+	int i, n;
+	char **words;
+	struct command *cmd;
+
+	memset(pl, '\0', sizeof(struct pipeline));
+
+	words = wordify(cmdline);
+	if (words == TC_NULL) {
+		perror("malloc");
+		return -1;
+	}
+	pl->words = words;
+
+	if (words[0] == TC_NULL) {
+		return 0;
+	}
+
+	cmd = &pl->cmds[0];
+	cmd->argv = words;
+	pl->ncmds = 1;
+
+	for (i = 0, n = 0; words[i] != TC_NULL; i++) {
+		if (isop(words[i], "|")) {
+			if (cmd->argc == 0 || pl->ncmds == MAXCMDS) {
+				tc_puterrln("shell: syntax error near '|'");
+				return -1;
+			}
+			words[n++] = TC_NULL;
+			cmd = &pl->cmds[pl->ncmds++];
+			cmd->argv = words + n;
+		} else if (isop(words[i], "<") || isop(words[i], ">") || isop(words[i], ">>")) {
+			if (words[i + 1] == TC_NULL || isop(words[i + 1], "|") || isop(words[i + 1], "<") || isop(words[i + 1], ">") || isop(words[i + 1], ">>")) {
+				tc_puterr("shell: syntax error near '");
+				tc_puterr(words[i]);
+				tc_puterrln("'");
+				return -1;
+			}
+			if (words[i][0] == '<') {
+				cmd->in = words[i + 1];
+			} else {
+				cmd->out = words[i + 1];
+				cmd->append = words[i][1] == '>';
+			}
+			i++;
+		} else {
+			words[n++] = words[i];
+			cmd->argc++;
+		}
+	}
+	words[n] = TC_NULL;
+
+	if (cmd->argc == 0) {
+		tc_puterrln("shell: syntax error near '|'");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* opens the redirections of cmd onto standard input and output */
+static int redirect(struct command *cmd) {
+
+	int fd;
+
+	if (cmd->in != TC_NULL) {
+		fd = open(cmd->in, O_RDONLY);
+		if (fd == -1) {
+			perror(cmd->in);
+			return -1;
+		}
+		dup2(fd, TC_STDIN);
+		close(fd);
+	}
+
+	if (cmd->out != TC_NULL) {
+		fd = open(cmd->out, O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC), 0666);
+		if (fd == -1) {
+			perror(cmd->out);
+			return -1;
+		}
+		dup2(fd, TC_STDOUT);
+		close(fd);
+	}
+
+	return 0;
+}
+
+static int builtin_cd(struct command *cmd) {
 
 	int rc;
+	char *dir;
 
-	if (strcmp(argv[0], "exit") == 0) {
-		done = 1;
+	dir = cmd->argc > 1 ? cmd->argv[1] : getenv("HOME");
+	if (dir == TC_NULL) {
 		return 1;
-	} else if (!strcmp(argv[0], "cd")) {
-		rc = chdir(argv[1]);
-		if (rc == -1) {
-			perror("chdir");
-		}
+	}
+
+	rc = chdir(dir);
+	if (rc == -1) {
+		perror("chdir");
 		return 1;
 	}
 
+	prompt_valid = 0;
 	return 0;
 }
 
-static int tryexternal(char *argv[]) {
+static int builtin_echo(struct command *cmd) {
+
+	int i;
+	int flag_n;
+
+	flag_n = cmd->argc > 1 && !strcmp(cmd->argv[1], "-n");
+	for (i = 1 + flag_n; i < cmd->argc; i++) {
+		tc_puts(TC_STDOUT, cmd->argv[i]);
+		if (i + 1 < cmd->argc) {
+			tc_puts(TC_STDOUT, " ");
+		}
+	}
+
+	if (flag_n == 0) {
+		tc_puts(TC_STDOUT, "\n");
+	}
+
+	return 0;
+}
+
+static int builtin_exit(struct command *cmd) {
+	done = 1;
+	return cmd->argc > 1 ? tc_atoi(cmd->argv[1]) : status;
+}
+
+static int builtin_false(struct command *cmd) {
+	return 1;
+}
+
+static int builtin_hash(struct command *cmd) {
+
+	int i;
+	struct hashent *e;
+
+	if (cmd->argc > 1 && !strcmp(cmd->argv[1], "-r")) {
+		hash_clear();
+		return 0;
+	}
+
+	for (i = 0; i < HASHSZ; i++) {
+		for (e = table[i]; e != TC_NULL; e = e->next) {
+			fprintf(stdout, "%u\t%s\n", e->hits, e->path);
+		}
+	}
+	fflush(stdout);
+
+	return 0;
+}
+
+static int builtin_true(struct command *cmd) {
+	return 0;
+}
+
+static struct builtin {
+	const char *name;
+	int (*fn)(struct command *cmd);
+} builtins[] = {
+	{ "cd", builtin_cd },
+	{ "echo", builtin_echo },
+	{ "exit", builtin_exit },
+	{ "false", builtin_false },
+	{ "hash", builtin_hash },
+	{ "true", builtin_true },
+	{ TC_NULL, TC_NULL }
+};
+
+/* runs a builtin in the shell itself, with any redirections applied
+ * temporarily. returns 1 if cmd was a builtin.
+ */
+static int tryinternal(struct command *cmd) {
+
+	int i;
+	int saved[2];
+
+	for (i = 0; builtins[i].name != TC_NULL; i++) {
+		if (!strcmp(cmd->argv[0], builtins[i].name)) {
+			break;
+		}
+	}
+	if (builtins[i].name == TC_NULL) {
+		return 0;
+	}
+
+	saved[0] = cmd->in != TC_NULL ? dup(TC_STDIN) : -1;
+	saved[1] = cmd->out != TC_NULL ? dup(TC_STDOUT) : -1;
+
+	if (redirect(cmd) == 0) {
+		status = builtins[i].fn(cmd);
+	} else {
+		status = 1;
+	}
+
+	if (saved[0] != -1) {
+		dup2(saved[0], TC_STDIN);
+		close(saved[0]);
+	}
+	if (saved[1] != -1) {
+		dup2(saved[1], TC_STDOUT);
+		close(saved[1]);
+	}
+
+	return 1;
+}
+
+static void notfound(char *name) {
+	tc_puterr("shell: ");
+	tc_puterr(name);
+	tc_puterrln(": command not found");
+}
+
+/* starts cmd with posix_spawn, which avoids copying the shell's page
+ * tables. in and out are the pipe ends to use for standard input and
+ * output, or -1.
+ */
+static pid_t spawn(struct command *cmd, char *path, int in, int out) {
+
+	int rc;
+	pid_t pid;
+	posix_spawn_file_actions_t actions;
+
+	posix_spawn_file_actions_init(&actions);
+	if (in != -1) {
+		posix_spawn_file_actions_adddup2(&actions, in, TC_STDIN);
+	}
+	if (out != -1) {
+		posix_spawn_file_actions_adddup2(&actions, out, TC_STDOUT);
+	}
+	if (cmd->in != TC_NULL) {
+		posix_spawn_file_actions_addopen(&actions, TC_STDIN, cmd->in, O_RDONLY, 0);
+	}
+	if (cmd->out != TC_NULL) {
+		posix_spawn_file_actions_addopen(&actions, TC_STDOUT, cmd->out, O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC), 0666);
+	}
+
+	rc = posix_spawn(&pid, path, &actions, TC_NULL, cmd->argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (rc != 0) {
+		errno = rc;
+		perror(cmd->argv[0]);
+		return -1;
+	}
+
+	return pid;
+}
+
+/* the original fork and exec path, kept for comparison (-f) */
+static pid_t forkexec(struct command *cmd, char *path, int in, int out) {
 
-	int wstatus;
 	pid_t pid;
 
 	pid = fork();
@@ -137,24 +518,128 @@ static int tryexternal(char *argv[]) {
 		perror("fork");
 		return -1;
 	} else if (pid == 0) {
-		execvp(argv[0], argv);
-		tc_exit(TC_EXIT_FAILURE);
+		if (in != -1) {
+			dup2(in, TC_STDIN);
+		}
+		if (out != -1) {
+			dup2(out, TC_STDOUT);
+		}
+		if (redirect(cmd) == -1) {
+			_exit(TC_EXIT_FAILURE);
+		}
+		execv(path, cmd->argv);
+		perror(cmd->argv[0]);
+		_exit(126);
 	}
 
-	waitpid(pid, &wstatus, 0);
-	return WEXITSTATUS(wstatus);
+	return pid;
+}
+
+/* starts every command of the pipeline at once, each one connected to the next by a pipe */
+static int tryexternal(struct pipeline *pl) {
+
+	int i;
+	int wstatus;
+	int fds[2];
+	int prev;
+	char *path;
+	pid_t pids[MAXCMDS];
+
+	prev = -1;
+	status = 0;
+	for (i = 0; i < pl->ncmds; i++) {
+		fds[0] = fds[1] = -1;
+		if (i + 1 < pl->ncmds) {
+			if (pipe(fds) == -1) {
+				perror("pipe");
+				status = 1;
+				break;
+			}
+			/* only the dup2'd copies should reach the children */
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		}
+
+		path = lookup(pl->cmds[i].argv[0]);
+		if (path == TC_NULL) {
+			notfound(pl->cmds[i].argv[0]);
+			pids[i] = -1;
+			status = 127;
+		} else {
+			pids[i] = (use_fork ? forkexec : spawn)(&pl->cmds[i], path, prev, fds[1]);
+			status = pids[i] == -1 ? 126 : 0;
+		}
+
+		if (prev != -1) {
+			close(prev);
+		}
+		if (fds[1] != -1) {
+			close(fds[1]);
+		}
+		prev = fds[0];
+	}
+
+	if (prev != -1) {
+		close(prev);
+	}
+
+	/* the pipeline's status is that of its last command */
+	while (i-- > 0) {
+		if (pids[i] != -1) {
+			waitpid(pids[i], &wstatus, 0);
+			if (i == pl->ncmds - 1) {
+				status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+			}
+		}
+	}
+
+	return status;
+}
+
+/* runs each ;-separated pipeline of a line */
+static void run(char *line) {
+
+	char *p, *next;
+	struct pipeline pl;
+
+	/* a # starting a word comments out the rest of the line, ; included */
+	for (p = line; *p != '\0'; p++) {
+		if (*p == '#' && (p == line || strchr(" \t\n\r|<>;", p[-1]) != TC_NULL)) {
+			*p = '\0';
+			break;
+		}
+	}
+
+	for (; line != TC_NULL && !done; line = next) {
+		next = strchr(line, ';');
+		if (next != TC_NULL) {
+			*next++ = '\0';
+		}
+
+		if (parse(line, &pl) == 0 && pl.ncmds > 0) {
+			if (pl.ncmds > 1 || !tryinternal(&pl.cmds[0])) {
+				tryexternal(&pl);
+			}
+		}
+
+		free(pl.words);
+	}
 }
 
 int main(int argc, char *argv[]) {
 
-	int ch;
-	char **cmdargv;
+	int interactive;
+	char *flag_c;
+	char *line;
+	FILE *input;
 	char *cmdline = TC_NULL;
 	size_t cap = 0;
 	ssize_t len = 0;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
+		{ .arg = 'c', .longarg = "command", .description = "run the given commands and exit", .has_value = 1 },
+		{ .arg = 'f', .longarg = "fork", .description = "start commands with fork and exec instead of posix_spawn", .has_value = 0 },
 		TC_PROG_ARG_HELP,
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
@@ -162,12 +647,15 @@ int main(int argc, char *argv[]) {
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "shell", .description = "launch command shell" },
+		{ .command = "shell build.sh", .description = "run the commands in build.sh" },
+		{ .command = "shell -c 'cd src; ls -1 | wc -l'", .description = "run commands given on the command line" },
+		{ .command = "echo 'ls -1 src | grep sh | sort > shells.txt' | shell", .description = "run a pipeline with its output redirected to a file" },
 		TC_PROG_EXAMPLE_END
 	};
 
 	static struct tc_prog prog = {
 		.program = "shell",
-		.usage = "[OPTIONS]",
+		.usage = "[OPTIONS] [FILE]",
 		.description = "command shell",
 		.package = TC_VERSION_NAME,
 		.version = TC_VERSION_STRING,
@@ -178,8 +666,17 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_c = TC_NULL;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'c':
+				flag_c = argval;
+				break;
+			case 'f':
+				use_fork = 1;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
@@ -193,30 +690,49 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	do {
-		prompt();
+	if (flag_c != TC_NULL) {
+		cmdline = tc_strdup(flag_c);
+		for (line = strtok(cmdline, "\n"); line != TC_NULL && !done; line = strtok(TC_NULL, "\n")) {
+			run(line);
+		}
+		free(cmdline);
+		hash_clear();
+		tc_exit(status);
+	}
 
-		len = getline(&cmdline, &cap, stdin);
-		if (len < 0) {
-			break;
+	input = stdin;
+	if (argc > 0) {
+		input = fopen(argv[0], "r");
+		if (input == TC_NULL) {
+			perror(argv[0]);
+			tc_exit(127);
 		}
+	}
 
-		cmdargv = argvify(cmdline);
-		if (cmdargv == TC_NULL) {
-			perror("malloc");
-			break;
+	interactive = input == stdin && tc_isatty(TC_STDOUT) == 1;
+
+	do {
+		if (interactive) {
+			prompt();
 		}
 
-		if (!tryinternal(cmdargv)) {
-			tryexternal(cmdargv);
+		len = getline(&cmdline, &cap, input);
+		if (len < 0) {
+			break;
 		}
 
-		free(cmdargv);
+		run(cmdline);
 
 	} while (!done);
 
+	if (input != stdin) {
+		fclose(input);
+	}
+
+	hash_clear();
+
 	free(cmdline);
 	cmdline = TC_NULL;
 
-	tc_exit(TC_EXIT_SUCCESS);
+	tc_exit(status);
 }
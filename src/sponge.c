@@ -20,21 +20,310 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHUNKSZ (1024 * 1024)
+#define DEFAULT_LIMIT 64 /* megabytes kept in memory before spilling */
+
+struct chunk {
+	struct chunk *next;
+	size_t len;
+	char data[CHUNKSZ];
+};
+
+/* standard input is soaked up in memory until limit bytes, then the whole
+ * thing moves to a temporary file beside the first target (or in $TMPDIR
+ * when that directory is read-only, or stays in memory as a last resort).
+ */
+struct spool {
+	struct chunk *head;
+	struct chunk *tail;
+	size_t inmem;
+	size_t limit;
+	int fd;
+	char path[PATH_MAX];
+	off_t size;
+};
+
+/* stores the directory part of path (or ".") in dir */
+static void directory(const char *path, char *dir) {
+	const char *slash;
+	size_t n;
+
+	slash = strrchr(path, '/');
+	if (slash == TC_NULL) {
+		strcpy(dir, ".");
+		return;
+	}
+	n = slash == path ? 1 : (size_t) (slash - path);
+	memcpy(dir, path, n);
+	dir[n] = '\0';
+}
+
+static int temp_beside(const char *target, char *path) {
+	char dir[PATH_MAX - 16];
+
+	if (tc_strlen(target) + 16 >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	directory(target, dir);
+	snprintf(path, PATH_MAX, "%s/.sponge.XXXXXX", dir);
+	return mkstemp(path);
+}
+
+/* somewhere to spill when the target's directory isn't writable */
+static int temp_elsewhere(char *path) {
+	const char *dir;
+
+	dir = getenv("TMPDIR");
+	dir = dir == TC_NULL || *dir == '\0' ? "/tmp" : dir;
+	if (tc_strlen((char *) dir) + 16 >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	snprintf(path, PATH_MAX, "%s/.sponge.XXXXXX", dir);
+	return mkstemp(path);
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return TC_ERR;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return TC_OK;
+}
+
+static void spool_fail(struct spool *sp, const char *msg) {
+	if (sp->fd != -1) {
+		close(sp->fd);
+		unlink(sp->path);
+	}
+	tc_puterrln((char *) msg);
+	tc_exit(TC_EXIT_FAILURE);
+}
+
+static void spool_read(struct spool *sp, const char *target) {
+	struct chunk *c;
+	ssize_t n;
+
+	for (;;) {
+		if (sp->tail == TC_NULL || sp->tail->len == CHUNKSZ) {
+			if (sp->fd != -1 && sp->tail != TC_NULL) {
+				/* spilled: the tail chunk is a write buffer */
+				if (write_all(sp->fd, sp->tail->data, sp->tail->len) != TC_OK) {
+					spool_fail(sp, "Write Error");
+				}
+				sp->tail->len = 0;
+			} else {
+				c = (struct chunk *) malloc(sizeof(struct chunk));
+				if (c == TC_NULL) {
+					spool_fail(sp, "Out of Memory");
+				}
+				c->next = TC_NULL;
+				c->len = 0;
+				if (sp->tail == TC_NULL) {
+					sp->head = c;
+				} else {
+					sp->tail->next = c;
+				}
+				sp->tail = c;
+			}
+		}
+
+		n = read(TC_STDIN, sp->tail->data + sp->tail->len, CHUNKSZ - sp->tail->len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1) {
+			spool_fail(sp, "File I/O Error");
+		} else if (n == 0) {
+			break;
+		}
+		sp->tail->len += n;
+		sp->size += n;
+
+		if (sp->fd == -1 && (sp->inmem += n) > sp->limit) {
+			sp->fd = temp_beside(target, sp->path);
+			if (sp->fd == -1) {
+				sp->fd = temp_elsewhere(sp->path);
+			}
+			if (sp->fd == -1) {
+				/* nowhere to spill, keep it all in memory */
+				sp->limit = (size_t) -1;
+				continue;
+			}
+			for (c = sp->head; c != TC_NULL && c != sp->tail; c = sp->head) {
+				if (write_all(sp->fd, c->data, c->len) != TC_OK) {
+					spool_fail(sp, "Write Error");
+				}
+				sp->head = c->next;
+				free(c);
+			}
+		}
+	}
+
+	if (sp->fd != -1 && sp->tail != TC_NULL) {
+		if (write_all(sp->fd, sp->tail->data, sp->tail->len) != TC_OK) {
+			spool_fail(sp, "Write Error");
+		}
+		sp->tail->len = 0;
+	}
+}
+
+static int spool_write(struct spool *sp, int fd) {
+	struct chunk *c;
+	off_t off;
+	ssize_t n;
+
+	if (sp->fd == -1) {
+		for (c = sp->head; c != TC_NULL; c = c->next) {
+			if (write_all(fd, c->data, c->len) != TC_OK) {
+				return TC_ERR;
+			}
+		}
+		return TC_OK;
+	}
+
+	/* the tail chunk is free to use as a copy buffer once spilled */
+	for (off = 0; off < sp->size; off += n) {
+		n = pread(sp->fd, sp->tail->data, CHUNKSZ, off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0 || write_all(fd, sp->tail->data, n) != TC_OK) {
+			return TC_ERR;
+		}
+	}
+
+	return TC_OK;
+}
+
+/* gives a replacement file the mode (and when possible the owner) of the
+ * file it replaces, or the usual mode of a new file.
+ */
+static void inherit(int fd, const struct stat *old, int exists) {
+	mode_t mask;
+
+	if (exists) {
+		if (fchown(fd, old->st_uid, old->st_gid) == -1) {
+			/* only root can give files away, keep our own ownership */
+		}
+		fchmod(fd, old->st_mode & 07777);
+	} else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+}
+
+/* writes the spool over target in place, creating it if need be */
+static int rewrite(struct spool *sp, const char *target, int sync) {
+	int fd;
+
+	fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		return TC_ERR;
+	}
+	if (spool_write(sp, fd) != TC_OK || (sync && fsync(fd) == -1)) {
+		close(fd);
+		return TC_ERR;
+	}
+	return close(fd) == 0 ? TC_OK : TC_ERR;
+}
+
+/* rename failures that writing the file in place can get around */
+static int can_rewrite(int err) {
+	return err == EACCES || err == EPERM || err == EXDEV || err == EBUSY;
+}
+
+/* regular files (that aren't hard links) are replaced atomically with a
+ * renamed temporary file, anything else is rewritten in place. so is a
+ * regular file when no temporary file can be made or renamed beside it.
+ */
+static int replace(struct spool *sp, const char *target, int last) {
+	struct stat st;
+	char path[PATH_MAX];
+	char tdir[PATH_MAX], sdir[PATH_MAX];
+	int exists, fd, err;
+
+	exists = lstat(target, &st) == 0;
+	if (exists && (!S_ISREG(st.st_mode) || st.st_nlink > 1)) {
+		return rewrite(sp, target, S_ISREG(st.st_mode));
+	}
+
+	/* the spill file is already beside the last target, just rename it */
+	if (last && sp->fd != -1) {
+		directory(target, tdir);
+		directory(sp->path, sdir);
+		if (tc_streql(tdir, sdir)) {
+			inherit(sp->fd, &st, exists);
+			if (fsync(sp->fd) == -1) {
+				return TC_ERR;
+			} else if (rename(sp->path, target) == -1) {
+				return can_rewrite(errno) ? rewrite(sp, target, 1) : TC_ERR;
+			}
+			close(sp->fd);
+			sp->fd = -1;
+			return TC_OK;
+		}
+	}
+
+	fd = temp_beside(target, path);
+	if (fd == -1) {
+		return rewrite(sp, target, 1);
+	}
+	inherit(fd, &st, exists);
+	if (spool_write(sp, fd) != TC_OK || fsync(fd) == -1) {
+		close(fd);
+		unlink(path);
+		return TC_ERR;
+	}
+	if (close(fd) == -1) {
+		unlink(path);
+		return TC_ERR;
+	}
+	if (rename(path, target) == -1) {
+		err = errno;
+		unlink(path);
+		return can_rewrite(err) ? rewrite(sp, target, 1) : TC_ERR;
+	}
+
+	return TC_OK;
+}
+
 int main(int argc, char *argv[]) {
 
-	int ch, i, rc;
-	int *fp;
+	int i, rc;
+	struct spool sp;
+	struct chunk *c;
 
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'm', .longarg = "memory", .description = "megabytes to hold in memory before using a temporary file (default 64)", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "ps | sponge foo.txt bar.txt", .description = "write the results of ps to foo.txt and bar.txt" },
+		{ .command = "sort big.txt | sponge big.txt", .description = "sort big.txt in place" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -51,11 +340,19 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	tc_memset(&sp, '\0', sizeof(struct spool));
+	sp.fd = -1;
+	sp.limit = (size_t) DEFAULT_LIMIT * 1024 * 1024;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'm':
+				sp.limit = (size_t) tc_atoi(argval) * 1024 * 1024;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -71,38 +368,27 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	fp = (int *) tc_malloc(sizeof(int) * argc);
-	if (fp == TC_NULL) {
-		tc_puterrln("Out of Memory");
-		tc_exit(TC_EXIT_FAILURE);
-	}
-	for (i = 0; i < argc; i++) {
-		fp[i] = TC_ERR;
-	}
+	/* nothing is opened until all of standard input has been read */
+	spool_read(&sp, argv[0]);
 
+	rc = TC_EXIT_SUCCESS;
 	for (i = 0; i < argc; i++) {
-		fp[i] = tc_open_writer(argv[i]);
-		if (fp[i] == TC_ERR) {
-			tc_puterr("Could not open file: ");
+		if (replace(&sp, argv[i], i == argc - 1) != TC_OK) {
+			tc_puterr("Could not write file: ");
 			tc_puterrln(argv[i]);
-			for (i = 0; i < argc; i++) {
-				if (fp[i] != TC_ERR) {
-					tc_close(fp[i]);
-				}
-			}
-			tc_exit(TC_EXIT_FAILURE);
+			rc = TC_EXIT_FAILURE;
 		}
 	}
 
-	while ((ch = tc_getc(TC_STDIN)) != TC_EOF) {
-		for (i = 0; i < argc; i++) {
-			tc_putc(fp[i], ch);
-		}
+	if (sp.fd != -1) {
+		close(sp.fd);
+		unlink(sp.path);
 	}
-
-	for (i = 0; i < argc; i++) {
-		tc_close(fp[i]);
+	while (sp.head != TC_NULL) {
+		c = sp.head;
+		sp.head = c->next;
+		free(c);
 	}
-	fp = tc_free(fp);
-	tc_exit(TC_EXIT_SUCCESS);
+
+	tc_exit(rc);
 }
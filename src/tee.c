@@ -18,22 +18,336 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOCKSZ (128 * 1024)
+#define QUEUELEN 64 /* blocks a sink may fall behind the reader */
+
+/* a block of input shared by every sink that still has to write it */
+struct block {
+	char data[BLOCKSZ];
+	size_t len;
+	int refs;
+	struct block *next; /* free list */
+};
+
+struct sink {
+	int fd;
+	const char *name;
+	pthread_t thread;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+	struct block *queue[QUEUELEN];
+	size_t head;
+	size_t count;
+	int failed;
+	unsigned long long dropped;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t available = PTHREAD_COND_INITIALIZER;
+static struct block *pool = TC_NULL;
+static int eof = 0;
+static int read_failed = 0; /* already reported, not a write error */
+
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return TC_ERR;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return TC_OK;
+}
+
+static void release(struct block *b) {
+	b->refs--;
+	if (b->refs == 0) {
+		b->next = pool;
+		pool = b;
+		pthread_cond_signal(&available);
+	}
+}
+
+static void *writer(void *arg) {
+	struct sink *s = (struct sink *) arg;
+	struct block *b;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (s->count == 0 && !eof) {
+			pthread_cond_wait(&s->nonempty, &lock);
+		}
+		if (s->count == 0) {
+			break;
+		}
+		b = s->queue[s->head];
+		s->head = (s->head + 1) % QUEUELEN;
+		s->count--;
+		pthread_cond_signal(&s->nonfull);
+		pthread_mutex_unlock(&lock);
+
+		/* a failed sink keeps draining so it never holds up the others */
+		if (!s->failed && write_all(s->fd, b->data, b->len) != TC_OK) {
+			s->failed = 1;
+		}
+
+		pthread_mutex_lock(&lock);
+		release(b);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return TC_NULL;
+}
+
+/* reads blocks and hands them to one writer thread per sink; a sink that
+ * is QUEUELEN blocks behind either stalls the reader or, with drop set,
+ * misses blocks until it catches up. Standard output is never dropped.
+ */
+static int fan_out(struct sink *sinks, int nsinks, int drop) {
+	struct block *blocks, *b;
+	ssize_t n;
+	size_t nblocks, i;
+	int j, rc;
+
+	/* enough blocks to fill every queue with one left for the reader */
+	nblocks = (size_t) nsinks * QUEUELEN + 1;
+	blocks = (struct block *) tc_malloc(sizeof(struct block) * nblocks);
+	if (blocks == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	for (i = 0; i < nblocks; i++) {
+		blocks[i].next = pool;
+		pool = &blocks[i];
+	}
+
+	for (j = 0; j < nsinks; j++) {
+		pthread_cond_init(&sinks[j].nonempty, TC_NULL);
+		pthread_cond_init(&sinks[j].nonfull, TC_NULL);
+		if (pthread_create(&sinks[j].thread, TC_NULL, writer, &sinks[j]) != 0) {
+			tc_puterrln("unexpected error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+
+	rc = TC_OK;
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (pool == TC_NULL) {
+			pthread_cond_wait(&available, &lock);
+		}
+		b = pool;
+		pool = b->next;
+		pthread_mutex_unlock(&lock);
+
+		do {
+			n = read(TC_STDIN, b->data, BLOCKSZ);
+		} while (n == -1 && errno == EINTR);
+		if (n == -1) {
+			perror("read");
+			read_failed = 1;
+		}
+		if (n <= 0) {
+			rc = n == 0 ? TC_OK : TC_ERR;
+			pthread_mutex_lock(&lock);
+			b->refs = 1;
+			release(b);
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		b->len = n;
+
+		pthread_mutex_lock(&lock);
+		b->refs = 1; /* held by the reader until every sink has it */
+		for (j = 0; j < nsinks; j++) {
+			if (sinks[j].count == QUEUELEN && drop && sinks[j].fd != TC_STDOUT) {
+				sinks[j].dropped += n;
+				continue;
+			}
+			while (sinks[j].count == QUEUELEN) {
+				pthread_cond_wait(&sinks[j].nonfull, &lock);
+			}
+			sinks[j].queue[(sinks[j].head + sinks[j].count) % QUEUELEN] = b;
+			sinks[j].count++;
+			b->refs++;
+			pthread_cond_signal(&sinks[j].nonempty);
+		}
+		release(b);
+		pthread_mutex_unlock(&lock);
+	}
+
+	pthread_mutex_lock(&lock);
+	eof = 1;
+	for (j = 0; j < nsinks; j++) {
+		pthread_cond_signal(&sinks[j].nonempty);
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (j = 0; j < nsinks; j++) {
+		pthread_join(sinks[j].thread, TC_NULL);
+		if (sinks[j].dropped > 0) {
+			fprintf(stderr, "tee: dropped %llu bytes for %s\n", sinks[j].dropped, sinks[j].name);
+		}
+		if (sinks[j].failed) {
+			rc = TC_ERR;
+		}
+	}
+
+	blocks = tc_free(blocks);
+	return rc;
+}
+
+#if defined(__linux__)
+static int splice_all(int in, int out, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = splice(in, TC_NULL, out, TC_NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return TC_ERR;
+		}
+		len -= n;
+	}
+
+	return TC_OK;
+}
+
+/* when standard input is a pipe and every sink is a pipe or a regular
+ * file the data never has to enter user space; returns the private pipes
+ * for zero_copy() or TC_NULL when that isn't possible.
+ */
+static int (*zero_copy_pipes(struct sink *sinks, int nsinks))[2] {
+	struct stat st;
+	int (*pipes)[2];
+	int j, k, size;
+
+	if (fstat(TC_STDIN, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+		return TC_NULL;
+	}
+	for (j = 0; j < nsinks; j++) {
+		if (fstat(sinks[j].fd, &st) == -1 || !(S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode))) {
+			return TC_NULL;
+		} else if (fcntl(sinks[j].fd, F_GETFL) & O_APPEND) {
+			return TC_NULL;
+		}
+	}
+
+	pipes = tc_malloc(sizeof(int[2]) * nsinks);
+	if (pipes == TC_NULL) {
+		tc_puterrln("Out of Memory");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	/* at least as large as the input pipe so tee(2) never falls short */
+	size = fcntl(TC_STDIN, F_GETPIPE_SZ);
+	for (j = 0; j < nsinks - 1; j++) {
+		if (pipe(pipes[j]) == -1 || (size > 0 && fcntl(pipes[j][1], F_SETPIPE_SZ, size) < size)) {
+			for (k = 0; k <= j; k++) {
+				close(pipes[k][0]);
+				close(pipes[k][1]);
+			}
+			pipes = tc_free(pipes);
+			return TC_NULL;
+		}
+	}
+
+	return pipes;
+}
+
+/* tee(2) duplicates the input into a private pipe for every sink but the
+ * last, each private pipe is spliced out, and then the input itself is
+ * spliced to the last sink.
+ */
+static int zero_copy(struct sink *sinks, int nsinks, int (*pipes)[2]) {
+	int j, rc;
+	ssize_t n, m;
+
+	rc = TC_OK;
+	for (;;) {
+		if (nsinks > 1) {
+			n = tee(TC_STDIN, pipes[0][1], INT_MAX, 0);
+		} else {
+			n = splice(TC_STDIN, TC_NULL, sinks[0].fd, TC_NULL, INT_MAX, SPLICE_F_MOVE | SPLICE_F_MORE);
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && nsinks > 1) {
+			/* tee() only ever writes to our own pipe, so this was the read */
+			perror("read");
+			read_failed = 1;
+			rc = TC_ERR;
+			break;
+		} else if (n <= 0) {
+			rc = n == 0 ? TC_OK : TC_ERR;
+			break;
+		} else if (nsinks == 1) {
+			continue;
+		}
+
+		for (j = 1; rc == TC_OK && j < nsinks - 1; j++) {
+			do {
+				m = tee(TC_STDIN, pipes[j][1], n, 0);
+			} while (m == -1 && errno == EINTR);
+			rc = m == n ? TC_OK : TC_ERR;
+		}
+		for (j = 0; rc == TC_OK && j < nsinks - 1; j++) {
+			rc = splice_all(pipes[j][0], sinks[j].fd, n);
+		}
+		if (rc != TC_OK || splice_all(TC_STDIN, sinks[nsinks-1].fd, n) != TC_OK) {
+			rc = TC_ERR;
+			break;
+		}
+	}
+
+	for (j = 0; j < nsinks - 1; j++) {
+		close(pipes[j][0]);
+		close(pipes[j][1]);
+	}
+
+	return rc;
+}
+#endif
+
 int main(int argc, char *argv[]) {
 
-	int ch, i, rc;
-	int *fd;
+	int i, rc, flag_d;
+	int (*pipes)[2];
+	struct sink *sinks;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'd', .longarg = "drop", .description = "drop data for files that fall behind instead of waiting, standard output still gets everything", .has_value = 0 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "ps | tee foo.txt", .description = "write the results of ps to foo.txt and standard output" },
+		{ .command = "producer | tee -d sample.log | gzip > all.gz", .description = "keep compressing everything even if writing sample.log falls behind" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -50,8 +364,14 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_d = 0;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'd':
+				flag_d = 1;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
@@ -70,50 +390,49 @@ int main(int argc, char *argv[]) {
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	fd = (int *) tc_malloc(sizeof(int) * argc);
-	if (fd == TC_NULL) {
+	/* every file plus standard output, which goes last */
+	sinks = (struct sink *) tc_malloc(sizeof(struct sink) * (argc + 1));
+	if (sinks == TC_NULL) {
 		tc_puterrln("Out of Memory");
 		tc_exit(TC_EXIT_FAILURE);
 	}
-	tc_memset(fd, TC_ERR, sizeof(int) * argc);
+	tc_memset(sinks, '\0', sizeof(struct sink) * (argc + 1));
 
 	for (i = 0; i < argc; i++) {
-		fd[i] = tc_open_writer(argv[i]);
-		if (fd[i] == TC_ERR) {
+		sinks[i].name = argv[i];
+		sinks[i].fd = tc_open_writer(argv[i]);
+		if (sinks[i].fd == TC_ERR) {
 			tc_puterrln("File I/O Error");
 			for (i = 0; i < argc; i++) {
-				if (fd[i] != TC_ERR) {
-					tc_close(fd[i]);
-					fd[i] = TC_ERR;
+				if (sinks[i].fd > 0) {
+					tc_close(sinks[i].fd);
 				}
 			}
 			tc_exit(TC_EXIT_FAILURE);
 		}
 	}
+	sinks[argc].name = "standard output";
+	sinks[argc].fd = TC_STDOUT;
 
-	while ((ch = tc_getc(TC_STDIN)) != TC_EOF) {
-		for (i = 0; i < argc; i++) {
-			rc = tc_putc(fd[i], ch);
-			if (rc == TC_EOF) {
-				tc_puterrln("Write Error");
-				for (i = 0; i < argc; i++) {
-					if (fd[i] != TC_ERR) {
-						tc_close(fd[i]);
-						fd[i] = TC_ERR;
-					}
-				}
-				tc_exit(TC_EXIT_FAILURE);
-			}
-		}
-		tc_putc(TC_STDOUT, ch);
+	pipes = TC_NULL;
+#if defined(__linux__)
+	if (!flag_d) {
+		pipes = zero_copy_pipes(sinks, argc + 1);
+	}
+	if (pipes != TC_NULL) {
+		rc = zero_copy(sinks, argc + 1, pipes);
+		pipes = tc_free(pipes);
+	} else
+#endif
+	rc = fan_out(sinks, argc + 1, flag_d);
+
+	if (rc != TC_OK && !read_failed) {
+		tc_puterrln("Write Error");
 	}
 
 	for (i = 0; i < argc; i++) {
-		if (fd[i] != TC_ERR) {
-			tc_close(fd[i]);
-			fd[i] = TC_ERR;
-		}
+		tc_close(sinks[i].fd);
 	}
-	fd = tc_free(fd);
-	tc_exit(TC_EXIT_SUCCESS);
+	sinks = tc_free(sinks);
+	tc_exit(rc == TC_OK ? TC_EXIT_SUCCESS : TC_EXIT_FAILURE);
 }
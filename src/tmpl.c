@@ -20,32 +20,208 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define C '}'
 #define O '{'
-#define L 2048
 #define D '$'
 #define Y '\\'
 #define S '%'
 
+#define MAXJOBS 256
+#define HASHSZ 256
+
+extern char **environ;
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+enum state { WAITING, RUNNING, DONE };
+
+/* a distinct placeholder command, run once no matter how often it appears */
+struct command {
+	char *text;
+	enum state state;
+	pid_t pid;
+	int fd;
+	struct buffer out;
+	struct command *next; /* hash chain */
+};
+
+/* the template as literal text and placeholders, in order */
+struct segment {
+	int kind; /* 0 for literal text, D or S for a placeholder */
+	size_t start; /* literal text is literals.data[start, end) */
+	size_t end;
+	struct command *cmd;
+};
+
+static void append(struct buffer *b, const char *s, size_t n) {
+	if (b->len + n + 1 > b->cap) {
+		b->cap = (b->len + n + 1) * 2;
+		b->data = (char *) realloc(b->data, b->cap);
+		if (b->data == TC_NULL) {
+			perror("malloc");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+}
+
+static void *grow(void *p, size_t n, size_t *cap, size_t size) {
+	if (n < *cap) {
+		return p;
+	}
+	*cap = *cap == 0 ? 64 : *cap * 2;
+	p = realloc(p, *cap * size);
+	if (p == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* returns the command for text, adding it the first time it's seen */
+static struct command *intern(struct command **table, struct command ***cmds, size_t *ncmds, size_t *cmdcap, const char *text, size_t len) {
+	struct command *cmd;
+	unsigned h;
+	size_t i;
+
+	h = 5381;
+	for (i = 0; i < len; i++) {
+		h = h * 33 + (unsigned char) text[i];
+	}
+	h %= HASHSZ;
+
+	for (cmd = table[h]; cmd != TC_NULL; cmd = cmd->next) {
+		if (strncmp(cmd->text, text, len) == 0 && cmd->text[len] == '\0') {
+			return cmd;
+		}
+	}
+
+	cmd = (struct command *) tc_malloc(sizeof(struct command));
+	if (cmd == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	tc_memset(cmd, '\0', sizeof(struct command));
+	cmd->text = (char *) tc_malloc(len + 1);
+	if (cmd->text == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	memcpy(cmd->text, text, len);
+	cmd->text[len] = '\0';
+	cmd->state = WAITING;
+	cmd->fd = -1;
+	cmd->next = table[h];
+	table[h] = cmd;
+
+	*cmds = (struct command **) grow(*cmds, *ncmds, cmdcap, sizeof(struct command *));
+	(*cmds)[(*ncmds)++] = cmd;
+
+	return cmd;
+}
+
+static int start(struct command *cmd) {
+	posix_spawn_file_actions_t actions;
+	char *argv[4];
+	int fds[2];
+	int rc;
+
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		return TC_ERR;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], TC_STDOUT);
+
+	argv[0] = "sh";
+	argv[1] = "-c";
+	argv[2] = cmd->text;
+	argv[3] = TC_NULL;
+	rc = posix_spawn(&cmd->pid, "/bin/sh", &actions, TC_NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+
+	if (rc != 0) {
+		errno = rc;
+		perror("posix_spawn");
+		close(fds[0]);
+		return TC_ERR;
+	}
+
+	cmd->fd = fds[0];
+	cmd->state = RUNNING;
+	return TC_OK;
+}
+
+/* prints a command's output, minus one trailing newline */
+static void emit(struct segment *seg) {
+	struct buffer *out = &seg->cmd->out;
+	size_t i, len;
+
+	len = out->len;
+	if (len > 0 && out->data[len - 1] == '\n') {
+		len--;
+	}
+
+	if (seg->kind == S) {
+		for (i = 0; i < len; i++) {
+			printf("&#%d;", (unsigned char) out->data[i]);
+		}
+	} else {
+		fwrite(out->data, 1, len, stdout);
+	}
+}
+
 int main(int argc, char *argv[]) {
 
+	int flag_j;
 	int ch;
-	char s[L];
+	char c;
+	size_t i, j, k;
+	size_t nsegs, segcap, ncmds, cmdcap, nrunning, next_cmd, next_seg;
+	ssize_t nread;
+	char *in;
+	size_t inlen;
+	struct buffer input, literals;
+	struct segment *segs;
+	struct command *table[HASHSZ];
+	struct command **cmds;
+	struct pollfd pfds[MAXJOBS];
+	struct command *pcmd[MAXJOBS];
+	char buf[64 * 1024];
 
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'j', .longarg = "jobs", .description = "number of placeholder commands to run at once (default 16)", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "tmpl < foo.tmpl > foo.html", .description = "tmpl < foo.tmpl > foo.html" },
+		{ .command = "tmpl -j 1 < foo.tmpl > foo.html", .description = "run placeholder commands one at a time" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -62,11 +238,18 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_j = 16;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'j':
+				flag_j = tc_atoi(argval);
+				flag_j = flag_j < 1 ? 1 : flag_j > MAXJOBS ? MAXJOBS : flag_j;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -77,63 +260,131 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	while ((ch = getc(stdin)) != EOF) {
-		int e;
-		if (ch == D || ch == S) {
-			int d;
-			d = getc(stdin);
-			if (d == O) {
-				FILE *p;
-				int h,i;
-
-				for (i = 0; i < L-1; i++) {
-					s[i] = (char) getc(stdin);
-					if (s[i] == EOF || s[i] == C) {
-						break;
-					}
-				}
-				s[i] = '\0';
+	tc_memset(&input, '\0', sizeof(struct buffer));
+	while ((nread = read(TC_STDIN, buf, sizeof(buf))) != 0) {
+		if (nread == -1 && errno == EINTR) {
+			continue;
+		} else if (nread == -1) {
+			perror("read");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+		append(&input, buf, nread);
+	}
+	in = input.data;
+	inlen = input.len;
 
-				if ((p = popen(s, "r")) == TC_NULL) {
-					perror("popen");
-					break;
-				}
-				while ((h = getc(p)) != EOF) {
-					if (h == '\n') {
-						int n;
-						n = getc(p);
-						if (n == EOF) {
-							break;
-						} else {
-							ungetc(n, p);
-						}
-					}
-					if (ch == S) {
-						printf("&#%d;", h);
-					} else {
-						putc(h, stdout);
-					}
+	/* split the template into literal text and placeholders */
+	tc_memset(&literals, '\0', sizeof(struct buffer));
+	tc_memset(table, '\0', sizeof(table));
+	segs = TC_NULL;
+	cmds = TC_NULL;
+	nsegs = segcap = ncmds = cmdcap = 0;
+
+	segs = (struct segment *) grow(segs, nsegs, &segcap, sizeof(struct segment));
+	segs[0].kind = 0;
+	segs[0].start = segs[0].end = 0;
+	nsegs = 1;
+
+	for (i = 0; i < inlen; ) {
+		ch = in[i++];
+		if (ch == D || ch == S) {
+			if (i == inlen) {
+				break;
+			} else if (in[i] == O) {
+				/* the command runs to } or the end of the template */
+				for (j = ++i; j < inlen && in[j] != C; j++) {
+					;
 				}
-				pclose(p);
+				segs = (struct segment *) grow(segs, nsegs + 1, &segcap, sizeof(struct segment));
+				segs[nsegs].kind = ch;
+				segs[nsegs].cmd = intern(table, &cmds, &ncmds, &cmdcap, in + i, j - i);
+				nsegs++;
+				segs[nsegs].kind = 0;
+				segs[nsegs].start = segs[nsegs].end = literals.len;
+				nsegs++;
+				i = j + 1;
 				continue;
-			} else if (d == EOF) {
-				break;
 			}
 
+			append(&literals, in + i - 1, 1);
+			ch = in[i++];
+		}
+		if (ch == Y && i < inlen && (in[i] == D || in[i] == S)) {
+			ch = in[i++];
+		}
+		c = (char) ch;
+		append(&literals, &c, 1);
+		segs[nsegs - 1].end = literals.len;
+	}
+
+	/* run the distinct commands, at most flag_j at a time, printing
+	 * the template as far as the finished ones allow
+	 */
+	next_cmd = next_seg = 0;
+	nrunning = 0;
+	while (next_seg < nsegs) {
+		while (next_cmd < ncmds && nrunning < (size_t) flag_j) {
+			if (start(cmds[next_cmd]) == TC_OK) {
+				nrunning++;
+			} else {
+				cmds[next_cmd]->state = DONE;
+			}
+			next_cmd++;
+		}
+
+		for (; next_seg < nsegs; next_seg++) {
+			if (segs[next_seg].kind == 0) {
+				fwrite(literals.data + segs[next_seg].start, 1, segs[next_seg].end - segs[next_seg].start, stdout);
+			} else if (segs[next_seg].cmd->state == DONE) {
+				emit(&segs[next_seg]);
+			} else {
+				break;
+			}
+		}
+		if (next_seg == nsegs || nrunning == 0) {
+			continue;
+		}
+		fflush(stdout);
 
-			putc(ch, stdout);
-			ch = d;
+		for (k = 0, j = 0; j < next_cmd; j++) {
+			if (cmds[j]->state == RUNNING) {
+				pfds[k].fd = cmds[j]->fd;
+				pfds[k].events = POLLIN;
+				pcmd[k] = cmds[j];
+				k++;
+			}
 		}
-		if (ch == Y) {
-			e = ch;
-			ch = getc(stdin);
-			if (!(ch == D || ch == S)) {
-				ungetc(ch, stdin);
-				ch = e;
+		if (poll(pfds, k, -1) == -1 && errno != EINTR) {
+			perror("poll");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+		for (j = 0; j < k; j++) {
+			if (pfds[j].revents == 0) {
+				continue;
+			}
+			nread = read(pcmd[j]->fd, buf, sizeof(buf));
+			if (nread > 0) {
+				append(&pcmd[j]->out, buf, nread);
+			} else if (nread == 0 || errno != EINTR) {
+				close(pcmd[j]->fd);
+				waitpid(pcmd[j]->pid, TC_NULL, 0);
+				pcmd[j]->state = DONE;
+				nrunning--;
 			}
 		}
-		putc(ch, stdout);
 	}
 
+	fflush(stdout);
+
+	for (i = 0; i < ncmds; i++) {
+		free(cmds[i]->out.data);
+		cmds[i]->text = tc_free(cmds[i]->text);
+		cmds[i] = tc_free(cmds[i]);
+	}
+	free(cmds);
+	free(segs);
+	free(literals.data);
+	free(input.data);
+
 	return TC_EXIT_SUCCESS;
 }
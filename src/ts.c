@@ -20,6 +20,7 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,28 +32,190 @@
 #define FMT_COMPACT "%Y%m%d%H%M%S"
 #define FMT_UNIX "%s"
 
-static void ts(char *fmt) {
-	time_t now;
-	struct tm *local;
-	char tstring[32];
-
-	now = time(TC_NULL);
-	local = localtime(&now);
-	tc_memset(tstring, '\0', sizeof(tstring));
-	strftime(tstring, sizeof(tstring)-1, fmt, local);
-	tc_puts(TC_STDOUT, "[");
-	tc_puts(TC_STDOUT, tstring);
-	tc_puts(TC_STDOUT, "] ");
+#define BLOCKSZ (128 * 1024)
+#define OUTSZ (256 * 1024)
+#define MAXPIECES 16
+#define PREFIXSZ 256
+
+enum mode { ABSOLUTE, ELAPSED, DELTA };
+
+/* the format split at each %N, the parts between go to strftime */
+struct piece {
+	char fmt[PREFIXSZ];
+	int digits; /* digits of %N following fmt, 0 for none */
+};
+
+static struct piece pieces[MAXPIECES];
+static int npieces;
+
+/* the timestamp text for the current second */
+static char cached[MAXPIECES][PREFIXSZ];
+static size_t cachedlen[MAXPIECES];
+static time_t cachedsec = -1;
+
+/* room for every piece at full length, its fraction digits, "[", "] " */
+static char prefix[MAXPIECES * (PREFIXSZ + 9) + 3];
+static size_t prefixlen;
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static void output(const char *s, size_t len) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < len; off += n) {
+		n = write(TC_STDOUT, s + off, len - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+}
+
+static void flush(void) {
+	output(out, outlen);
+	outlen = 0;
+}
+
+static void append(const char *s, size_t len) {
+	if (outlen + len > OUTSZ) {
+		flush();
+	}
+	if (len > OUTSZ) {
+		output(s, len);
+		return;
+	}
+	memcpy(out + outlen, s, len);
+	outlen += len;
+}
+
+/* splits fmt at each %N (or %3N, %6N, ...) for nanoseconds */
+static void compile(const char *fmt) {
+	const char *p;
+	char *q, *qend;
+	int digits;
+
+	npieces = 0;
+	q = pieces[0].fmt;
+	qend = q + PREFIXSZ - 1;
+	for (p = fmt; *p != '\0'; p++) {
+		digits = 0;
+		if (p[0] == '%' && p[1] == 'N') {
+			digits = 9;
+		} else if (p[0] == '%' && p[1] >= '1' && p[1] <= '9' && p[2] == 'N') {
+			digits = p[1] - '0';
+		}
+
+		if (digits > 0 && npieces < MAXPIECES - 1) {
+			*q = '\0';
+			pieces[npieces++].digits = digits;
+			q = pieces[npieces].fmt;
+			qend = q + PREFIXSZ - 1;
+			p += p[1] == 'N' ? 1 : 2;
+			continue;
+		}
+
+		if (p[0] == '%' && p[1] == '%' && q + 1 < qend) {
+			*q++ = *p++;
+		}
+		if (q < qend) {
+			*q++ = *p;
+		}
+	}
+	*q = '\0';
+	pieces[npieces++].digits = 0;
+}
+
+/* renders the fractional digits of nsec */
+static size_t fraction(char *p, long nsec, int digits) {
+	int i;
+
+	for (i = 9; i > digits; i--) {
+		nsec /= 10;
+	}
+	for (i = digits - 1; i >= 0; i--) {
+		p[i] = '0' + nsec % 10;
+		nsec /= 10;
+	}
+	return digits;
+}
+
+/* rebuilds the prefix for now, only calling localtime/strftime when the second changes */
+static void stamp(struct timespec *now) {
+	struct tm local;
+	char *p;
+	int i;
+
+	if (now->tv_sec != cachedsec) {
+		localtime_r(&now->tv_sec, &local);
+		for (i = 0; i < npieces; i++) {
+			cachedlen[i] = pieces[i].fmt[0] == '\0' ? 0 : strftime(cached[i], PREFIXSZ, pieces[i].fmt, &local);
+		}
+		cachedsec = now->tv_sec;
+	}
+
+	p = prefix;
+	*p++ = '[';
+	for (i = 0; i < npieces; i++) {
+		memcpy(p, cached[i], cachedlen[i]);
+		p += cachedlen[i];
+		if (pieces[i].digits > 0) {
+			p += fraction(p, now->tv_nsec, pieces[i].digits);
+		}
+	}
+	*p++ = ']';
+	*p++ = ' ';
+	prefixlen = p - prefix;
+}
+
+/* renders a duration as seconds.microseconds */
+static void stamp_duration(struct timespec *now, struct timespec *since) {
+	char tmp[32];
+	char *p, *end;
+	long long sec;
+	long nsec;
+
+	sec = now->tv_sec - since->tv_sec;
+	nsec = now->tv_nsec - since->tv_nsec;
+	if (nsec < 0) {
+		sec--;
+		nsec += 1000000000L;
+	}
+
+	end = tmp + sizeof(tmp);
+	p = end - 6;
+	fraction(p, nsec, 6);
+	*--p = '.';
+	do {
+		*--p = '0' + sec % 10;
+		sec /= 10;
+	} while (sec > 0);
+
+	prefix[0] = '[';
+	memcpy(prefix + 1, p, end - p);
+	prefixlen = 1 + (end - p);
+	prefix[prefixlen++] = ']';
+	prefix[prefixlen++] = ' ';
 }
 
 int main(int argc, char *argv[]) {
 
-	int ch, pch;
+	int bol;
 	char *fmt;
+	char *buf, *p, *end, *nl;
+	ssize_t nread;
+	enum mode mode;
+	struct timespec now, start, last;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		{ .arg = 'c', .longarg = "compact", .description = "filename safe format (YYYYmmddHHMMSS)", .has_value = 0 },
+		{ .arg = 'd', .longarg = "delta", .description = "seconds since the previous line", .has_value = 0 },
+		{ .arg = 'e', .longarg = "elapsed", .description = "seconds since ts started", .has_value = 0 },
+		{ .arg = 'f', .longarg = "format", .description = "strftime format, %N (or %3N, %6N, ...) for fractions of a second", .has_value = 1 },
 		TC_PROG_ARG_HELP,
 		{ .arg = 'i', .longarg = "iso8601", .description = "ISO8601 format", .has_value = 0 },
 		{ .arg = 'u', .longarg = "unix", .description = "UNIX timestamp", .has_value = 0 },
@@ -62,6 +225,8 @@ int main(int argc, char *argv[]) {
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "food | ts > foo.log", .description = "add timestamps to lines from standard input" },
+		{ .command = "food | ts -f '%H:%M:%S.%3N'", .description = "add timestamps with milliseconds" },
+		{ .command = "make 2>&1 | ts -d", .description = "show how long each line of output took" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -80,12 +245,22 @@ int main(int argc, char *argv[]) {
 
 	/* defaults */
 	fmt = FMT_HUMAN;
+	mode = ABSOLUTE;
 
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'c':
 				fmt = FMT_COMPACT;
 				break;
+			case 'd':
+				mode = DELTA;
+				break;
+			case 'e':
+				mode = ELAPSED;
+				break;
+			case 'f':
+				fmt = argval;
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
@@ -105,15 +280,54 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-	ts(fmt);
-	pch = 0;
-	while ((ch = tc_getc(TC_STDIN)) != TC_EOF) {
-		if (pch == '\n') {
-			ts(fmt);
+	compile(fmt);
+
+	buf = (char *) tc_malloc(BLOCKSZ);
+	if (buf == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+
+	bol = 1;
+	while ((nread = read(TC_STDIN, buf, BLOCKSZ)) != 0) {
+		if (nread == -1 && errno == EINTR) {
+			continue;
+		} else if (nread == -1) {
+			perror("read");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+
+		/* lines in one read arrived together, so they share a timestamp */
+		if (mode == ABSOLUTE) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			stamp(&now);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			stamp_duration(&now, mode == ELAPSED ? &start : &last);
 		}
-		tc_putc(TC_STDOUT, ch);
-		pch = ch;
+
+		for (p = buf, end = buf + nread; p < end; p = nl) {
+			if (bol) {
+				append(prefix, prefixlen);
+				if (mode == DELTA) {
+					last = now;
+					stamp_duration(&now, &last);
+				}
+			}
+			nl = memchr(p, '\n', end - p);
+			nl = nl == TC_NULL ? end : nl + 1;
+			bol = nl[-1] == '\n';
+			append(p, nl - p);
+		}
+
+		/* don't hold back output of a live program */
+		flush();
 	}
 
+	buf = tc_free(buf);
+
 	tc_exit(TC_EXIT_SUCCESS);
 }
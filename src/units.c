@@ -18,80 +18,460 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <tc/tc.h>
 
-double C_to_F(double value) { return (((value / 5.0) * 9.0) + 32.0); }
-double F_to_C(double value) { return (((value - 32.0) * 5.0) / 9.0); }
-double cm_to_in(double value) { return (value / 2.54); }
-double cm_to_m(double value) { return (value / 100.0); }
-double ft_to_in(double value) { return (value * 12.0); }
-double kg_to_lb(double value) { return (value / 0.453592); }
-double in_to_cm(double value) { return (value * 2.54); }
-double in_to_ft(double value) { return (value / 12.0); }
-double lb_to_kg(double value) { return (value * 0.453592); }
+#define BLOCKSZ (1024 * 1024)
+#define OUTSZ (256 * 1024)
+#define MAXLINES (64 * 1024)
+#define MAXPRECISION 17
 
+/* an edge in the unit graph, unit_out = unit_in * scale + offset */
 struct conversion {
 	char *unit_in;
 	char *unit_out;
-	double (*converter)(double value);
+	double scale;
+	double offset;
 };
 
 struct conversion conversions[] = {
-	{ "C", "F", C_to_F },
-	{ "F", "C", F_to_C },
-	{ "cm", "in", cm_to_in },
-	{ "cm", "m", cm_to_m },
-	{ "ft", "in", ft_to_in },
-	{ "kg", "lb", kg_to_lb },
-	{ "in", "ft", in_to_ft },
-	{ "in", "cm", in_to_cm },
-	{ "lb", "kg", lb_to_kg }
+	{ "C", "F", 9.0 / 5.0, 32.0 },
+	{ "C", "K", 1.0, 273.15 },
+	{ "cm", "in", 1.0 / 2.54, 0.0 },
+	{ "cm", "m", 1.0 / 100.0, 0.0 },
+	{ "mm", "cm", 1.0 / 10.0, 0.0 },
+	{ "m", "km", 1.0 / 1000.0, 0.0 },
+	{ "ft", "in", 12.0, 0.0 },
+	{ "yd", "ft", 3.0, 0.0 },
+	{ "mi", "ft", 5280.0, 0.0 },
+	{ "kg", "lb", 1.0 / 0.453592, 0.0 },
+	{ "g", "kg", 1.0 / 1000.0, 0.0 },
+	{ "lb", "oz", 16.0, 0.0 }
 };
 #define NCONVERSIONS (sizeof(conversions)/sizeof(conversions[0]))
+#define MAXUNITS (NCONVERSIONS * 2)
 
-int convert(char *unit_in, char *unit_out, double value_in, double *value_out) {
+/* a conversion composed into one step, out = in * scale + offset */
+struct affine {
+	double scale;
+	double offset;
+};
+
+/* a line of input and the span of the field holding its value */
+struct line {
+	char *start;
+	char *field;
+	char *field_end;
+	char *end;
+	int ok;
+};
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static const double powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int unit_index(char *units[], int nunits, char *unit) {
 
 	int i;
 
+	for (i = 0; i < nunits; i++) {
+		if (tc_streql(units[i], unit) == 1) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* finds a path from unit_in to unit_out, walking edges in either
+ * direction, and composes the steps along it into one transform
+ */
+int convert(char *unit_in, char *unit_out, struct affine *result) {
+
+	int i, j, n;
+	int from, to;
+	int nunits;
+	int head, tail;
+	int queue[MAXUNITS];
+	int seen[MAXUNITS];
+	char *units[MAXUNITS];
+	struct affine path[MAXUNITS];
+	struct affine step;
+
+	nunits = 0;
 	for (i = 0; i < NCONVERSIONS; i++) {
-		if (tc_streql(unit_in, conversions[i].unit_in) == 1 &&
-			tc_streql(unit_out, conversions[i].unit_out) == 1) {
+		if (unit_index(units, nunits, conversions[i].unit_in) == -1) {
+			units[nunits++] = conversions[i].unit_in;
+		}
+		if (unit_index(units, nunits, conversions[i].unit_out) == -1) {
+			units[nunits++] = conversions[i].unit_out;
+		}
+	}
+
+	from = unit_index(units, nunits, unit_in);
+	to = unit_index(units, nunits, unit_out);
+	if (from == -1 || to == -1) {
+		return TC_ERR;
+	}
+
+	memset(seen, '\0', sizeof(seen));
+	path[from].scale = 1.0;
+	path[from].offset = 0.0;
+	seen[from] = 1;
+	queue[0] = from;
 
-			*value_out = conversions[i].converter(value_in);
+	/* breadth first, so the fewest steps (and roundings) are used */
+	for (head = 0, tail = 1; head < tail; head++) {
+		i = queue[head];
+		if (i == to) {
+			*result = path[to];
 			return TC_OK;
 		}
+		for (j = 0; j < NCONVERSIONS; j++) {
+			if (tc_streql(conversions[j].unit_in, units[i]) == 1) {
+				n = unit_index(units, nunits, conversions[j].unit_out);
+				step.scale = conversions[j].scale;
+				step.offset = conversions[j].offset;
+			} else if (tc_streql(conversions[j].unit_out, units[i]) == 1) {
+				n = unit_index(units, nunits, conversions[j].unit_in);
+				step.scale = 1.0 / conversions[j].scale;
+				step.offset = -conversions[j].offset / conversions[j].scale;
+			} else {
+				continue;
+			}
+			if (seen[n]) {
+				continue;
+			}
+			seen[n] = 1;
+			path[n].scale = path[i].scale * step.scale;
+			path[n].offset = path[i].offset * step.scale + step.offset;
+			queue[tail++] = n;
+		}
 	}
 
 	return TC_ERR;
 }
 
+static void flush(void) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < outlen; off += n) {
+		n = write(TC_STDOUT, out + off, outlen - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	outlen = 0;
+}
+
+static void append(const char *s, size_t len) {
+	if (outlen + len > OUTSZ) {
+		flush();
+	}
+	if (len > OUTSZ) {
+		memcpy(out, s, OUTSZ);
+		outlen = OUTSZ;
+		flush();
+		append(s + OUTSZ, len - OUTSZ);
+		return;
+	}
+	memcpy(out + outlen, s, len);
+	outlen += len;
+}
+
+/* parses a decimal number from s to end. numbers with up to 19
+ * significant digits and a small exponent are exact as a double
+ * product or quotient; anything else goes to strtod.
+ */
+static int parse(char *s, char *end, double *value) {
+
+	char *p;
+	char tmp[64];
+	tc_uint64_t mant;
+	int neg, ndigits, exp, e, eneg;
+
+	p = s;
+	neg = *p == '-';
+	if (p < end && (*p == '-' || *p == '+')) {
+		p++;
+	}
+
+	mant = 0;
+	ndigits = exp = 0;
+	for (; p < end && tc_isdigit(*p); p++, ndigits++) {
+		mant = mant * 10 + (*p - '0');
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && tc_isdigit(*p); p++, ndigits++, exp--) {
+			mant = mant * 10 + (*p - '0');
+		}
+	}
+	if (ndigits == 0) {
+		return TC_ERR;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		eneg = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+')) {
+			p++;
+		}
+		if (p == end || !tc_isdigit(*p)) {
+			return TC_ERR;
+		}
+		for (e = 0; p < end && tc_isdigit(*p); p++) {
+			e = e < 10000 ? e * 10 + (*p - '0') : e;
+		}
+		exp += eneg ? -e : e;
+	}
+	if (p != end) {
+		return TC_ERR;
+	}
+
+	if (ndigits <= 19 && mant < (1ULL << 53) && exp >= -22 && exp <= 22) {
+		*value = exp < 0 ? (double) mant / powers[-exp] : (double) mant * powers[exp];
+		*value = neg ? -*value : *value;
+		return TC_OK;
+	}
+
+	if ((size_t) (end - s) >= sizeof(tmp)) {
+		return TC_ERR;
+	}
+	memcpy(tmp, s, end - s);
+	tmp[end - s] = '\0';
+	*value = strtod(tmp, TC_NULL);
+	return TC_OK;
+}
+
+/* printf("%.*f") into p, returning what was written even when truncated */
+static size_t slow_format(char *p, size_t size, double value, int precision) {
+	int n;
+
+	n = snprintf(p, size, "%.*f", precision, value);
+	if (n < 0) {
+		p[0] = '\0';
+		return 0;
+	}
+	return (size_t) n >= size ? size - 1 : (size_t) n;
+}
+
+/* renders value with precision decimals into p (of size bytes), as printf("%.*f") would */
+static size_t format(char *p, size_t size, double value, int precision) {
+
+	char tmp[32];
+	char *end, *digit;
+	double r, frac;
+	tc_uint64_t n;
+	int i, neg;
+
+	r = value * powers[precision];
+	neg = value < 0 || (value == 0 && 1 / value < 0);
+	r = neg ? -r : r;
+	if (!(r < 9e15)) {
+		/* too big to scale exactly, or inf / nan */
+		return slow_format(p, size, value, precision);
+	}
+
+	n = (tc_uint64_t) r;
+	frac = r - (double) n;
+	if (frac > 0.5 - 1e-9 && frac < 0.5 + 1e-9) {
+		/* too close to a tie to round the scaled value */
+		return slow_format(p, size, value, precision);
+	}
+	n += frac > 0.5;
+
+	end = tmp + sizeof(tmp);
+	for (i = 0; i < precision; i++) {
+		*--end = '0' + n % 10;
+		n /= 10;
+	}
+	if (precision > 0) {
+		*--end = '.';
+	}
+	do {
+		*--end = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+
+	digit = p;
+	if (neg) {
+		*digit++ = '-';
+	}
+	memcpy(digit, end, tmp + sizeof(tmp) - end);
+	return (digit - p) + (tmp + sizeof(tmp) - end);
+}
+
+/* locates field column (1 based, 0 for the whole line) of each line */
+static void split(struct line *l, int column, char delim) {
+
+	char *p;
+	int i;
+
+	l->field = l->start;
+	l->field_end = l->end;
+	for (i = 1; i < column; i++) {
+		p = memchr(l->field, delim, l->end - l->field);
+		if (p == TC_NULL) {
+			l->ok = 0;
+			return;
+		}
+		l->field = p + 1;
+	}
+	if (column > 0) {
+		p = memchr(l->field, delim, l->end - l->field);
+		l->field_end = p == TC_NULL ? l->end : p;
+	}
+
+	while (l->field < l->field_end && tc_isspace(*l->field)) {
+		l->field++;
+	}
+	while (l->field_end > l->field && tc_isspace(l->field_end[-1])) {
+		l->field_end--;
+	}
+	l->ok = 1;
+}
+
+/* converts a block of values in one pass */
+static void transform(double *values, size_t n, struct affine *t) {
+
+	size_t i;
+	double scale = t->scale;
+	double offset = t->offset;
+
+	for (i = 0; i < n; i++) {
+		values[i] = values[i] * scale + offset;
+	}
+}
+
+/* prints each line with its field replaced by the converted value, lines without a number pass through */
+static void emit(struct line *lines, double *values, size_t n, int precision) {
+
+	char num[352];
+	size_t i, len;
+
+	for (i = 0; i < n; i++) {
+		if (lines[i].ok) {
+			append(lines[i].start, lines[i].field - lines[i].start);
+			len = format(num, sizeof(num), values[i], precision);
+			append(num, len);
+			append(lines[i].field_end, lines[i].end - lines[i].field_end);
+		} else {
+			append(lines[i].start, lines[i].end - lines[i].start);
+		}
+		append("\n", 1);
+	}
+}
+
+static void stream(int fd, struct affine *t, int column, char delim, int precision) {
+
+	static struct line lines[MAXLINES];
+	static double values[MAXLINES];
+	char *buf, *p, *nl, *end;
+	size_t len, n, nvalues;
+	ssize_t nread;
+	int eof;
+
+	buf = (char *) tc_malloc(BLOCKSZ);
+	if (buf == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+
+	len = 0;
+	eof = 0;
+	while (!eof || len > 0) {
+		if (!eof && len < BLOCKSZ) {
+			nread = read(fd, buf + len, BLOCKSZ - len);
+			if (nread == -1 && errno == EINTR) {
+				continue;
+			} else if (nread == -1) {
+				perror("read");
+				tc_exit(TC_EXIT_FAILURE);
+			}
+			eof = nread == 0;
+			len += nread;
+		}
+
+		/* gather complete lines, parsing their values */
+		p = buf;
+		end = buf + len;
+		for (n = nvalues = 0; n < MAXLINES && p < end; n++) {
+			nl = memchr(p, '\n', end - p);
+			if (nl == TC_NULL) {
+				if (!eof && p != buf) {
+					break; /* finish the line with the next read */
+				} else if (!eof) {
+					tc_puterrln("units: line too long");
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				nl = end;
+			}
+			lines[n].start = p;
+			lines[n].end = nl;
+			split(&lines[n], column, delim);
+			if (lines[n].ok) {
+				lines[n].ok = parse(lines[n].field, lines[n].field_end, &values[n]) == TC_OK;
+			}
+			p = nl + (nl < end);
+			nvalues++;
+		}
+
+		transform(values, nvalues, t);
+		emit(lines, values, nvalues, precision);
+
+		len = end - p;
+		memmove(buf, p, len);
+	}
+
+	flush();
+	buf = tc_free(buf);
+}
+
 int main(int argc, char *argv[]) {
 
 	int rc;
+	int flag_c;
+	int flag_p;
+	char flag_d;
 	double value_in;
 	double value_out;
 	char *unit_in;
 	char *unit_out;
+	char num[352];
+	struct affine t;
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
+		{ .arg = 'c', .longarg = "column", .description = "convert this column of CSV input instead of whole lines", .has_value = 1 },
+		{ .arg = 'd', .longarg = "delimiter", .description = "CSV field delimiter (default ',')", .has_value = 1 },
 		TC_PROG_ARG_HELP,
+		{ .arg = 'p', .longarg = "precision", .description = "number of decimal places to print (default 2)", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "units 32C F", .description = "convert 32 Celsius to Ferinheight" },
+		{ .command = "units mm ft < lengths.txt", .description = "convert every line of lengths.txt from millimetres to feet" },
+		{ .command = "units -c 3 -p 1 C F < readings.csv", .description = "convert the third column of a CSV file from Celsius to Ferinheight" },
 		TC_PROG_EXAMPLE_END
 	};
 
 	static struct tc_prog prog = {
 		.program = "units",
-		.usage = "[OPTIONS] INPUT_VALUE_UNIT OUTPUT_UNIT",
+		.usage = "[OPTIONS] INPUT_VALUE_UNIT|INPUT_UNIT OUTPUT_UNIT",
 		.description = "convert between units of measure",
 		.package = TC_VERSION_NAME,
 		.version = TC_VERSION_STRING,
@@ -102,11 +482,27 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_c = 0;
+	flag_d = ',';
+	flag_p = 2;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
+			case 'c':
+				flag_c = tc_atoi(argval);
+				flag_c = flag_c < 0 ? 0 : flag_c;
+				break;
+			case 'd':
+				flag_d = argval[0];
+				break;
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'p':
+				flag_p = tc_atoi(argval);
+				flag_p = flag_p < 0 ? 0 : flag_p > MAXPRECISION ? MAXPRECISION : flag_p;
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -125,13 +521,21 @@ int main(int argc, char *argv[]) {
 	value_in = strtod(argv[0], &unit_in);
 	unit_out = argv[1];
 
-	rc = convert(unit_in, unit_out, value_in, &value_out);
+	rc = convert(unit_in, unit_out, &t);
 	if (rc == TC_ERR) {
 		tc_puterrln("Invalid Conversion");
 		tc_exit(TC_EXIT_FAILURE);
 	}
 
-	fprintf(stdout, "%.2lf%s\n", value_out, unit_out);
+	/* no value given, convert standard input */
+	if (unit_in == argv[0]) {
+		stream(TC_STDIN, &t, flag_c, flag_d, flag_p);
+		tc_exit(TC_EXIT_SUCCESS);
+	}
+
+	value_out = value_in * t.scale + t.offset;
+	num[format(num, sizeof(num), value_out, flag_p)] = '\0';
+	fprintf(stdout, "%s%s\n", num, unit_out);
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
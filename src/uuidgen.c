@@ -18,37 +18,213 @@
     SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
 
-#define UUID_VERSION ('4')
-#define UUID_VARIANT ('b')
+#define UUID_VERSION (0x40)
+#define UUID_VARIANT (0xb0)
 
-int main(int argc, char *argv[]) {
+#define ENTROPYSZ (64 * 1024)
+#define OUTSZ (256 * 1024)
+#define UUIDLEN 37 /* 36 characters and a newline */
+
+static tc_uint8_t entropy[ENTROPYSZ];
+static size_t entropy_used = ENTROPYSZ;
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static char hex[256][2];
+
+/* the clock is read once per CLOCKREUSE UUIDs, about a microsecond of
+ * work, which is well inside COMB's 10us and v7's 1ms resolution
+ */
+#define CLOCKREUSE 16
+
+static struct timespec cached_now;
+static int cached_uses = CLOCKREUSE;
+
+static void refill(void) {
+	ssize_t got;
+	size_t off;
+#if !defined(__linux__)
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1) {
+		tc_exit(TC_EXIT_FAILURE);
+	}
+#endif
+
+	for (off = 0; off < ENTROPYSZ; off += got) {
+#if defined(__linux__)
+		got = getrandom(entropy + off, ENTROPYSZ - off, 0);
+#else
+		got = read(fd, entropy + off, ENTROPYSZ - off);
+#endif
+		if (got == -1 && errno == EINTR) {
+			got = 0;
+		} else if (got <= 0) {
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
 
+#if !defined(__linux__)
+	close(fd);
+#endif
+	entropy_used = 0;
+}
+
+/* hands out random bytes, refilling the pool a block at a time */
+static void random_bytes(tc_uint8_t *p, size_t n) {
+	if (entropy_used + n > ENTROPYSZ) {
+		refill();
+	}
+
+	memcpy(p, entropy + entropy_used, n);
+	entropy_used += n;
+}
+
+static void flush(void) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < outlen; off += n) {
+		n = write(TC_STDOUT, out + off, outlen - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	outlen = 0;
+}
+
+static void now(struct timespec *ts) {
+	if (cached_uses++ >= CLOCKREUSE) {
+		clock_gettime(CLOCK_REALTIME, &cached_now);
+		cached_uses = 1;
+	}
+	*ts = cached_now;
+}
+
+static void format(tc_uint8_t uuid[16]) {
+	char *p;
 	int i;
-	int rc;
 
-	struct timeval tv;
+	if (outlen + UUIDLEN > OUTSZ) {
+		flush();
+	}
+
+	p = out + outlen;
+	for (i = 0; i < 16; i++) {
+		memcpy(p, hex[uuid[i]], 2);
+		p += 2;
+		if (i == 3 || i == 5 || i == 7 || i == 9) {
+			*p++ = '-';
+		}
+	}
+	*p++ = '\n';
+	outlen += UUIDLEN;
+}
+
+/* COMB: a 48-bit timestamp in units of 10us followed by random bits */
+static void comb(tc_uint8_t uuid[16]) {
+	struct timespec t;
 	tc_uint64_t ts;
-	FILE *fp;
-	tc_uint8_t random_bytes[18];
-	size_t len;
+	int i;
+
+	now(&t);
+	ts = ((tc_uint64_t) t.tv_sec * 100000) + t.tv_nsec / 10000; /* combine s + us */
+
+	for (i = 0; i < 6; i++) {
+		uuid[i] = (ts >> (40 - (i * 8))) & 0xFF;
+	}
+
+	random_bytes(uuid + 6, 10);
+	uuid[6] = UUID_VERSION | (uuid[6] & 0x0F);
+	uuid[8] = UUID_VARIANT | (uuid[8] & 0x0F);
+}
+
+/* RFC 9562 UUIDv7: a 48-bit millisecond timestamp, then a 26-bit counter
+ * (rand_a and the top of rand_b, the RFC's fixed bit-length counter) that
+ * keeps IDs within the same millisecond in order; 48 random bits remain
+ */
+#define COUNTERMAX 0x3FFFFFF
+
+static void v7(tc_uint8_t uuid[16]) {
+	static tc_uint64_t last_ms = 0;
+	static tc_uint32_t counter = 0;
+	struct timespec t;
+	tc_uint64_t ms;
+	int i;
+
+	now(&t);
+	ms = (tc_uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+	if (ms <= last_ms && counter >= COUNTERMAX) {
+		/* out of counter, see if the clock has moved on before borrowing a millisecond */
+		cached_uses = CLOCKREUSE;
+		now(&t);
+		ms = (tc_uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+	}
+
+	random_bytes(uuid + 6, 10);
+	if (ms > last_ms) {
+		/* start each millisecond at a random count below half, leaving room to count up */
+		counter = (((tc_uint32_t) uuid[6] << 24) | (uuid[7] << 16) | (uuid[8] << 8) | uuid[9]) & (COUNTERMAX >> 1);
+		last_ms = ms;
+	} else if (++counter > COUNTERMAX) {
+		/* counter exhausted (or the clock went back), borrow the next millisecond */
+		counter = 0;
+		last_ms++;
+	}
+
+	for (i = 0; i < 6; i++) {
+		uuid[i] = (last_ms >> (40 - (i * 8))) & 0xFF;
+	}
+	uuid[6] = 0x70 | (counter >> 22);
+	uuid[7] = (counter >> 14) & 0xFF;
+	uuid[8] = 0x80 | ((counter >> 8) & 0x3F);
+	uuid[9] = counter & 0xFF;
+}
+
+int main(int argc, char *argv[]) {
+
+	int i;
+	int flag_v;
+	long long flag_n;
+	long long n;
+	tc_uint8_t uuid[16];
 
 	struct tc_prog_arg *arg;
 
 	static struct tc_prog_arg args[] = {
 		TC_PROG_ARG_HELP,
+		{ .arg = 'n', .longarg = "count", .description = "number of UUIDs to generate (default 1)", .has_value = 1 },
+		{ .arg = 'v', .longarg = "uuid-version", .description = "4 for COMB UUIDs (default), 7 for RFC 9562 UUIDv7", .has_value = 1 },
 		TC_PROG_ARG_VERSION,
 		TC_PROG_ARG_END
 	};
 
 	static struct tc_prog_example examples[] = {
 		{ .command = "uuidgen", .description = "show a new UUID" },
+		{ .command = "uuidgen -n 1000000 -v 7 > keys.txt", .description = "generate a million time ordered UUIDv7 keys" },
 		TC_PROG_EXAMPLE_END
 	};
 
@@ -65,11 +241,25 @@ int main(int argc, char *argv[]) {
 		.examples = examples
 	};
 
+	/* defaults */
+	flag_n = 1;
+	flag_v = 4;
+
 	while ((arg = tc_args_process(&prog, argc, argv)) != TC_NULL) {
 		switch (arg->arg) {
 			case 'h':
 				tc_args_show_help(&prog);
 				break;
+			case 'n':
+				flag_n = strtoll(argval, TC_NULL, 10);
+				break;
+			case 'v':
+				flag_v = tc_atoi(argval);
+				if (flag_v != 4 && flag_v != 7) {
+					tc_puterrln("uuidgen: version must be 4 or 7");
+					tc_exit(TC_EXIT_FAILURE);
+				}
+				break;
 			case 'V':
 				tc_args_show_version(&prog);
 				break;
@@ -80,64 +270,21 @@ int main(int argc, char *argv[]) {
 	argc -= argi;
 	argv += argi;
 
-
-	rc = gettimeofday(&tv, TC_NULL);
-	if (rc == -1) {
-		tc_exit(TC_EXIT_FAILURE);
+	for (i = 0; i < 256; i++) {
+		hex[i][0] = "0123456789abcdef"[i >> 4];
+		hex[i][1] = "0123456789abcdef"[i & 0x0F];
 	}
 
-	tv.tv_usec /= 10;			/* round to 10us resolution */
-	ts = (tv.tv_sec * 100000) + tv.tv_usec; /* combine s + us */
-
-
-	fp = fopen("/dev/urandom", "r");
-	if (fp == TC_NULL) {
-		tc_exit(TC_EXIT_FAILURE);
-	}
-	len = fread(random_bytes, sizeof(random_bytes[0]), sizeof(random_bytes)/sizeof(random_bytes[0]), fp);
-	if (len != sizeof(random_bytes)/sizeof(random_bytes[0])) {
-		tc_exit(TC_EXIT_FAILURE);
-	}
-	rc = fclose(fp);
-	if (rc == -1) {
-		tc_exit(TC_EXIT_FAILURE);
-	}
-
-	/* print timestamp portion '01234567-89ab' */
-	for (i = 3; i <= 8; i++) {
-		tc_uint8_t byte = ((ts>>(64 - (i*8))) & 0xFF);
-		fprintf(stdout, "%01x", (0xF0 & byte) >> 4);
-		fprintf(stdout, "%01x", (0x0F & byte));
-		if (i == 6) {
-			fprintf(stdout, "-");
+	for (n = 0; n < flag_n; n++) {
+		if (flag_v == 7) {
+			v7(uuid);
+		} else {
+			comb(uuid);
 		}
+		format(uuid);
 	}
 
-	/* rather than make this complicated, we get 18 random bytes and use
-	 * the lower 4 bytes instead of getting 9 random bytes and using both
-	 * low and high bits
-	 */
-
-	/* print '-' and version followed by 3 random hex digits */
-	fprintf(stdout, "-%c", UUID_VERSION);
-	for (i = 0; i < 3; i++) {
-		fprintf(stdout, "%01x", (0x0F & random_bytes[i]));
-	}
-
-	/* print '-' and variant followed by 3 random hex digits */
-	fprintf(stdout, "-%c", UUID_VARIANT);
-	for (i = 3; i < 6; i++) {
-		fprintf(stdout, "%01x", (0x0F & random_bytes[i]));
-	}
-
-	/* print '-' followed by 12 random hex digits */
-	fprintf(stdout, "-");
-	for (i = 6; i < 18; i++) {
-		fprintf(stdout, "%01x", (0x0F & random_bytes[i]));
-	}
-
-	/* done */
-	fprintf(stdout, "\n");
+	flush();
 
 	tc_exit(TC_EXIT_SUCCESS);
 }
@@ -20,23 +20,69 @@
 
 #include <tc/tc.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#define OUTSZ (256 * 1024)
+
+/* a word of the mmap'd dictionary, already cut at \r, \n or ' */
+struct word {
+	size_t off;
+	size_t len;
+};
+
+static char out[OUTSZ];
+static size_t outlen = 0;
+
+static void flush(void) {
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < outlen; off += n) {
+		n = write(TC_STDOUT, out + off, outlen - off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+		} else if (n <= 0) {
+			tc_puterrln("Write Error");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+	}
+	outlen = 0;
+}
+
+static void output(const char *s, size_t len) {
+	size_t k;
+
+	while (len > 0) {
+		k = OUTSZ - outlen < len ? OUTSZ - outlen : len;
+		memcpy(out + outlen, s, k);
+		outlen += k;
+		s += k;
+		len -= k;
+		if (outlen == OUTSZ) {
+			flush();
+		}
+	}
+}
+
 int main(int argc, char *argv[]) {
 
 
 	unsigned seed;
 	unsigned long c, i, j, n;
-	FILE *dict = TC_NULL, *f;
-	long *words = TC_NULL;
-	size_t cap=0, dcap = 8192, dlen = 0, dinc = 8192, nel;
-	ssize_t len = 0;
-	int ch, d;
-	char *a, *w, *ln = TC_NULL;
+	FILE *f;
+	struct word *words = TC_NULL, *wd;
+	struct stat st;
+	size_t dlen = 0, nel, off, start[257], pos[257], *order = TC_NULL;
+	int ch, fd;
+	char d, *a, *w, *data, *nl, *q;
 
 	static struct option long_options[] = {
 		{ "help", no_argument, 0, 'h' },
@@ -120,9 +166,9 @@ int main(int argc, char *argv[]) {
 
 	tc_srand(seed);
 
-	dict = fopen(w, "r");
-	if (dict == TC_NULL) {
-		perror("fopen");
+	fd = open(w, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
 		fprintf(stderr, "Could not open /usr/share/dict/words\n");
 		fprintf(stderr, "To use an alternative dictionary do:\n");
 		fprintf(stderr, "xkcdpass -w /path/to/dict\n");
@@ -130,52 +176,94 @@ int main(int argc, char *argv[]) {
 		w = TC_NULL;
 		tc_exit(TC_EXIT_FAILURE);
 	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		fprintf(stderr, "xkcdpass: %s: empty or unreadable word list\n", w);
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	data = mmap(TC_NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		tc_exit(TC_EXIT_FAILURE);
+	}
 
-	words = (long *) malloc(sizeof(long) * dcap);
-	words[dlen++] = 0;
-	while ((len = getline(&ln, &cap, dict)) > 0) {
-		if (dlen == dcap) {
-			dcap += dinc;
-			words = (long *) realloc(words, sizeof(long)*dcap);
-			if (words == TC_NULL) {
-				perror("realloc");
-				free(ln);
+	/* one entry per line, with the \n, \r and anything from ' on cut off up front */
+	for (off = 0; off < (size_t) st.st_size; off = nl - data + 1) {
+		nl = memchr(data + off, '\n', (size_t) st.st_size - off);
+		if (nl == TC_NULL) {
+			nl = data + st.st_size;
+		}
+		dlen++;
+	}
+	words = (struct word *) malloc(sizeof(struct word) * dlen);
+	if (words == TC_NULL) {
+		perror("malloc");
+		tc_exit(TC_EXIT_FAILURE);
+	}
+	for (off = 0, wd = words; off < (size_t) st.st_size; off = nl - data + 1, wd++) {
+		nl = memchr(data + off, '\n', (size_t) st.st_size - off);
+		if (nl == TC_NULL) {
+			nl = data + st.st_size;
+		}
+		wd->off = off;
+		wd->len = (size_t) (nl - data) - off;
+		if (wd->len > 0 && data[off + wd->len - 1] == '\r') {
+			wd->len--;
+		}
+		q = memchr(data + off, '\'', wd->len);
+		if (q != TC_NULL) {
+			wd->len = (size_t) (q - data) - off;
+		}
+	}
+
+	/* acrostic letters draw straight from the words sharing that first byte */
+	if (a != TC_NULL) {
+		order = (size_t *) malloc(sizeof(size_t) * dlen);
+		if (order == TC_NULL) {
+			perror("malloc");
+			tc_exit(TC_EXIT_FAILURE);
+		}
+		memset(start, 0, sizeof(start));
+		for (off = 0; off < dlen; off++) {
+			start[(unsigned char) data[words[off].off] + 1]++;
+		}
+		for (j = 1; j < 257; j++) {
+			start[j] += start[j - 1];
+		}
+		memcpy(pos, start, sizeof(start));
+		for (off = 0; off < dlen; off++) {
+			order[pos[(unsigned char) data[words[off].off]]++] = off;
+		}
+		for (j = 0; j < n; j++) {
+			if (start[(unsigned char) a[j]] == start[(unsigned char) a[j] + 1]) {
+				fprintf(stderr, "xkcdpass: no word in %s begins with '%c'\n", w, a[j]);
 				tc_exit(TC_EXIT_FAILURE);
 			}
 		}
-		words[dlen++] = ftell(dict);
 	}
 
 	for (i = 0; i < c; i++) {
-		printf("> ");
+		output("> ", 2);
 		for (j = 0; j < n; j++) {
-			unsigned r = (unsigned) tc_rand() % (dlen-1);
-			fseek(dict, words[r], SEEK_SET);
-			len = getline(&ln, &cap, dict);
-			if (len <= 0) {
-				break;
-			}
-
-			if (a != TC_NULL && ln[0] != a[j]) {
-				j--;
-				continue;
+			if (a == TC_NULL) {
+				wd = &words[(unsigned) tc_rand() % dlen];
+			} else {
+				ch = (unsigned char) a[j];
+				wd = &words[order[start[ch] + (unsigned) tc_rand() % (start[ch + 1] - start[ch])]];
 			}
-
-			if (ln[tc_strlen(ln)-1] == '\n') ln[tc_strlen(ln)-1]='\0';
-			if (ln[tc_strlen(ln)-1] == '\r') ln[tc_strlen(ln)-1]='\0';
-			if (strstr(ln, "'") != TC_NULL) *(strstr(ln, "'")) = '\0';
-			printf("%s", ln);
+			output(data + wd->off, wd->len);
 			if (j + 1 < n) {
-				printf("%c", d);
+				output(&d, 1);
 			}
 		}
-		printf("\n");
+		output("\n", 1);
 	}
+	flush();
 
+	munmap(data, (size_t) st.st_size);
+	close(fd);
 	free(w);
 	free(words);
-	fclose(dict);
+	if (order != TC_NULL) free(order);
 	if (a != TC_NULL) free(a);
-	if (ln != TC_NULL) free(ln);
 	tc_exit(TC_EXIT_SUCCESS);
 }